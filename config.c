@@ -0,0 +1,171 @@
+/*****************************************************************************
+ * Description       : Configuration cache for VBIT
+ * Compiler          : GCC (WinAVR)
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file config.c
+ * In-RAM configuration with write-behind
+ */
+
+#include "config.h"
+
+CONFIG g_Config;
+
+static uint32_t dirty;		// CONFIG_ bits waiting to be written
+static uint16_t changeTime;	// TaskTime of the last change
+
+/** \return The test.ini key of an opt-out frame
+ */
+static const char *FrameKey(uint8_t type)
+{
+	return type==OPTOUT_PREROLL?"preroll":type==OPTOUT_START?"start":"stop";
+} // FrameKey
+
+void ConfigLoad(void)
+{
+	char str[sizeof(g_Header)+1];
+	char key[]="channel0";
+	uint8_t i;
+	// outputodd and outputeven have always been read with room for 17 actions
+	ini_gets("service", "outputodd",  "111Q2233P44556678Q", g_Config.outputOdd, OUTPUTACTIONS, inifile);
+	ini_gets("service", "outputeven", "111Q2233P44556678Q", g_Config.outputEven, OUTPUTACTIONS, inifile);
+	ini_gets("service", "header",     "mpp MRG DAY dd MTH", str, sizeof(str), inifile);
+	strncpy(g_Header,str,sizeof(g_Header));	// A full header isn't capped, same as H
+	g_Config.serialMode=ini_getl("service", "serialmode", 0, inifile);
+	g_Config.fifoMin=ini_getl("service", "fifomin", FIFOMINDEPTH, inifile);
+	g_Config.fifoMax=ini_getl("service", "fifomax", MAXFIFOINDEX, inifile);
+	g_Config.deltaCycle=ini_getl("service", "deltacycle", 0, inifile);
+	g_Config.fastextBoost=ini_getl("service", "fastextboost", 0, inifile);
+	g_Config.p830Period=ini_getl("schedule", "p830period", 50, inifile);
+	g_Config.p830Count=ini_getl("schedule", "p830count", 1, inifile);
+	g_Config.dbPeriod=ini_getl("schedule", "dbperiod", 1, inifile);
+	g_Config.dbCount=ini_getl("schedule", "dbcount", 0, inifile);
+	g_Config.optOutRepeats=ini_getl("optout", "repeats", 3, inifile);
+	g_Config.optOutCadence=ini_getl("optout", "cadence", 5, inifile);
+	ini_gets("p830f1", "label", "VBITFax             ", g_Config.label, sizeof(g_Config.label), inifile);
+	ini_gets("p830f1", "nic", "2a2f", g_Config.nic, sizeof(g_Config.nic), inifile);
+	ini_gets("p830f1", "initialpage", "003F7F", g_Config.initialPage, sizeof(g_Config.initialPage), inifile);
+	ini_gets("optout", "address", "000242", g_Config.optOutAddress, sizeof(g_Config.optOutAddress), inifile);
+	for (i=0;i<OPTOUTTYPES;i++)
+		ini_gets("optout", FrameKey(i), i==OPTOUT_START?OPTOUTSTARTDEFAULT:"",
+			g_Config.optOutFrame[i], sizeof(g_Config.optOutFrame[i]), inifile);
+	for (i=0;i<DBCHANNELS;i++)
+	{
+		key[7]='0'+i;
+		ini_gets("databroadcast", key, i?"":"9,1,0", g_Config.dbChannel[i], sizeof(g_Config.dbChannel[i]), inifile);	// Channel 0 is SISCom
+	}
+	dirty=0;
+} // ConfigLoad
+
+/** Write one setting to test.ini
+ * \param key : A single CONFIG_ bit
+ * \return 0 if minIni failed
+ */
+static int ConfigWrite(uint32_t key)
+{
+	char str[sizeof(g_Header)+1];
+	uint8_t i;
+	for (i=0;i<OPTOUTTYPES;i++)
+		if (key==CONFIG_OPTOUTFRAME<<i)
+			return ini_puts("optout", FrameKey(i), g_Config.optOutFrame[i], inifile);
+	for (i=0;i<DBCHANNELS;i++)
+		if (key==CONFIG_DBCHANNEL<<i)
+		{
+			strcpy(str,"channel0");
+			str[7]+=i;
+			return ini_puts("databroadcast", str, g_Config.dbChannel[i], inifile);
+		}
+	switch (key)
+	{
+	case CONFIG_HEADER:
+		memcpy(str,g_Header,sizeof(g_Header));	// g_Header may not be capped
+		str[sizeof(g_Header)]=0;
+		return ini_puts("service", "header", str, inifile);
+	case CONFIG_OUTPUTODD:
+		return ini_puts("service", "outputodd", g_Config.outputOdd, inifile);
+	case CONFIG_OUTPUTEVEN:
+		return ini_puts("service", "outputeven", g_Config.outputEven, inifile);
+	case CONFIG_SERIALMODE:
+		return ini_putl("service", "serialmode", g_Config.serialMode, inifile);
+	case CONFIG_FIFOMIN:
+		return ini_putl("service", "fifomin", g_Config.fifoMin, inifile);
+	case CONFIG_FIFOMAX:
+		return ini_putl("service", "fifomax", g_Config.fifoMax, inifile);
+	case CONFIG_DELTACYCLE:
+		return ini_putl("service", "deltacycle", g_Config.deltaCycle, inifile);
+	case CONFIG_FASTEXTBOOST:
+		return ini_putl("service", "fastextboost", g_Config.fastextBoost, inifile);
+	case CONFIG_P830PERIOD:
+		return ini_putl("schedule", "p830period", g_Config.p830Period, inifile);
+	case CONFIG_P830COUNT:
+		return ini_putl("schedule", "p830count", g_Config.p830Count, inifile);
+	case CONFIG_DBPERIOD:
+		return ini_putl("schedule", "dbperiod", g_Config.dbPeriod, inifile);
+	case CONFIG_DBCOUNT:
+		return ini_putl("schedule", "dbcount", g_Config.dbCount, inifile);
+	case CONFIG_OPTOUTREPEATS:
+		return ini_putl("optout", "repeats", g_Config.optOutRepeats, inifile);
+	case CONFIG_OPTOUTCADENCE:
+		return ini_putl("optout", "cadence", g_Config.optOutCadence, inifile);
+	case CONFIG_LABEL:
+		return ini_puts("p830f1", "label", g_Config.label, inifile);
+	case CONFIG_NIC:
+		return ini_puts("p830f1", "nic", g_Config.nic, inifile);
+	case CONFIG_OPTOUTADDRESS:
+		return ini_puts("optout", "address", g_Config.optOutAddress, inifile);
+	}
+	return 1;
+} // ConfigWrite
+
+/** A step of the write-behind job. Writes one changed setting.
+ * \return 0 when everything has been written, 1 if there is more to do, TASKWAIT during the delay
+ */
+static uint8_t ConfigStep(void)
+{
+	uint32_t key;
+	if (!dirty)
+		return 0;
+	if (!TaskExpired(changeTime,CONFIGDELAY))
+		return TASKWAIT;	// Still changing
+	key=dirty & -dirty;	// Lowest bit
+	dirty&=~key;
+	// ini_puts rewrites the whole file. Fill the FIFO first so that it lasts as long as possible.
+	TaskYield();
+	if (!ConfigWrite(key))
+		xprintf(PSTR("[ConfigStep] Could not write setting %08lX\n\r"),key);
+	return dirty!=0;
+} // ConfigStep
+
+void ConfigChanged(uint32_t keys)
+{
+	dirty|=keys;
+	changeTime=TaskTime();
+	TaskAddJob(ConfigStep);
+} // ConfigChanged
@@ -0,0 +1,111 @@
+/*****************************************************************************
+ * Description       : Configuration cache for VBIT
+ * Compiler          : GCC (WinAVR)
+ *
+ * Every setting in test.ini is read once, at LoadINISettings, into g_Config.
+ * After that, commands read and change the settings in RAM. minIni reparses the
+ * file on every call and ini_puts rewrites all of it, so changes are written back
+ * later by a background job, one key at a time. A burst of changes to a setting
+ * (a scheduler updating the header every few seconds, say) costs one write.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \brief In-RAM configuration with write-behind
+*/
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include "avr_compiler.h"
+#include <avr/pgmspace.h>
+#include "xitoa.h"
+#include "vbit.h"
+
+// Changed settings that still have to be written to test.ini. One bit per key.
+#define CONFIG_HEADER			0x00000001UL	// service header. The value is in g_Header.
+#define CONFIG_OUTPUTODD		0x00000002UL	// service outputodd
+#define CONFIG_OUTPUTEVEN		0x00000004UL	// service outputeven
+#define CONFIG_SERIALMODE		0x00000008UL	// service serialmode
+#define CONFIG_FIFOMIN			0x00000010UL	// service fifomin
+#define CONFIG_FIFOMAX			0x00000020UL	// service fifomax
+#define CONFIG_DELTACYCLE		0x00000040UL	// service deltacycle
+#define CONFIG_FASTEXTBOOST		0x00000080UL	// service fastextboost
+#define CONFIG_P830PERIOD		0x00000100UL	// schedule p830period
+#define CONFIG_P830COUNT		0x00000200UL	// schedule p830count
+#define CONFIG_DBPERIOD			0x00000400UL	// schedule dbperiod
+#define CONFIG_DBCOUNT			0x00000800UL	// schedule dbcount
+#define CONFIG_OPTOUTREPEATS	0x00001000UL	// optout repeats
+#define CONFIG_OPTOUTCADENCE	0x00002000UL	// optout cadence
+#define CONFIG_LABEL			0x00004000UL	// p830f1 label
+#define CONFIG_NIC				0x00008000UL	// p830f1 nic
+#define CONFIG_OPTOUTADDRESS	0x00010000UL	// optout address
+#define CONFIG_OPTOUTFRAME		0x00020000UL	// optout preroll, start, stop. Frame n is CONFIG_OPTOUTFRAME<<n
+#define CONFIG_DBCHANNEL		0x00100000UL	// databroadcast channel0..3. Channel n is CONFIG_DBCHANNEL<<n
+
+// How long a setting has to stay the same before it is written (TaskTime ticks, 1s)
+#define CONFIGDELAY			(1000*TASKTICKSPERMS)
+
+#define OUTPUTACTIONS		18
+
+typedef struct
+{
+	char outputOdd[OUTPUTACTIONS+1];	// QD, QO. A copy, because insert changes g_OutputActions
+	char outputEven[OUTPUTACTIONS+1];	// QO
+	uint8_t serialMode;		// QM
+	uint8_t fifoMin;		// QF
+	uint8_t fifoMax;
+	uint8_t deltaCycle;		// QR
+	uint8_t fastextBoost;	// QB
+	uint8_t p830Period;		// QS0
+	uint8_t p830Count;
+	uint8_t dbPeriod;		// QS1
+	uint8_t dbCount;
+	uint8_t optOutRepeats;	// WR
+	uint8_t optOutCadence;
+	char optOutAddress[OPTOUTADDRESSLENGTH+1];			// WA
+	char optOutFrame[OPTOUTTYPES][OPTOUTDATALENGTH*2+1];	// WD. In hex
+	char dbChannel[DBCHANNELS][DBCHANNELSETTING];		// ZC. address,weight,repeats
+	char label[21];			// GUD. 8/30 status label
+	char nic[5];			// GUN. Network identification code
+	char initialPage[7];	// ppssss. Not used yet
+} CONFIG;
+
+extern CONFIG g_Config;
+
+/** Read test.ini into g_Config and g_Header.
+ * LoadINISettings then hands the settings to their modules.
+ */
+void ConfigLoad(void);
+
+/** Call after changing a setting in g_Config (or g_Header).
+ * The background job writes it to test.ini when it has been left alone for CONFIGDELAY.
+ * \param keys : CONFIG_ bits of the settings that have changed
+ */
+void ConfigChanged(uint32_t keys);
+
+#endif
@@ -4,60 +4,193 @@
 // Copyright 2004-2006 (c) MRG Systems Ltd.
 
 #include "databroadcast.h"
+#include "vbit.h"
 
 int nServicePacketAddress;  /// Address can be 0 to 15 (default 2). TODO: Make more flexible?
 
-static RingBuff_t DBbuffer;
+// The queue proper is in the serial RAM, split equally between the channels. See vbi.h
+typedef struct
+{
+	uint16_t base;		// Offset of this channel's part of the queue
+	uint16_t head;		// Offset in its part of the next byte to send
+	uint16_t count;		// Number of bytes waiting
+	char address[6];	// Nibbles
+	uint8_t ial;		// Address length 1..6
+	uint8_t weight;		// Share of the databroadcast lines. 0 is off.
+	uint8_t repeats;	// How many times each packet is sent again
+	uint8_t repeat;		// Which go of the current packet is next. 0 is the first.
+	uint8_t sending;	// DL of the current packet
+	uint8_t continuity;	// CI of the current packet
+	int16_t credit;		// For the weighted round robin
+} DBCHANNEL;
+
+static DBCHANNEL channel[DBCHANNELS];
+
+void InitDataBroadcast(void)
+{
+	uint8_t i;
+	for (i=0;i<DBCHANNELS;i++)
+	{
+		channel[i].base=i*DBCHANNELSIZE;
+		channel[i].head=0;
+		channel[i].count=0;
+		channel[i].repeat=0;
+	}
+}
+
+static uint8_t HexNibble(char ch)
+{
+	if (ch>='0' && ch<='9')
+		return ch-'0';
+	ch=toupper(ch);
+	if (ch>='A' && ch<='F')
+		return ch-'A'+10;
+	return 0xff;
+} // HexNibble
 
-/** Send a string to the ring buffer
- * \param str : String to send to the ring buffer
- * \result 0 if the string was accepted. A pointer to the last char sent. 
- * A non zero result should be used to resend the 
+uint8_t DataBroadcastConfigure(uint8_t ch, char *setting)
+{
+	DBCHANNEL *c;
+	char address[6];
+	uint8_t ial;
+	long weight;
+	long repeats;
+	char *ptr;
+	if (ch>=DBCHANNELS)
+		return 1;
+	c=&channel[ch];
+	if (!*setting || *setting=='\r' || *setting=='\n')
+	{
+		c->weight=0;	// Channel off
+		return 0;
+	}
+	for (ial=0;ial<6 && HexNibble(setting[ial])!=0xff;ial++)
+		address[ial]=HexNibble(setting[ial]);
+	ptr=&setting[ial];
+	if (!ial || *ptr++!=',' || !xatoi(&ptr,&weight) || *ptr++!=',' || !xatoi(&ptr,&repeats) ||
+		weight<0 || weight>100 || repeats<0 || repeats>15)
+		return 1;
+	memcpy(c->address,address,ial);
+	c->ial=ial;
+	c->weight=weight;
+	c->repeats=repeats;
+	c->repeat=0;	// Any packet that was being repeated is finished with
+	c->credit=0;
+	return 0;
+} // DataBroadcastConfigure
+
+uint16_t DataBroadcastFree(uint8_t ch)
+{
+	if (ch>=DBCHANNELS)
+		return 0;
+	return DBCHANNELSIZE-channel[ch].count;
+} // DataBroadcastFree
+
+/** Copy bytes onto the end of a channel's queue.
+ * The caller has checked that they fit and that the FIFO isn't busy.
  */
-char* putringstring(char* str)
+static void QueueWrite(DBCHANNEL *c, uint8_t *data, uint16_t len)
 {
-	// xputs(PSTR("P"));
-	char *c=str;
-	for (;*c;c++)
+	uint16_t tail;
+	uint16_t n;
+	PORTC.OUT&=~VBIT_SEL; // Set the mux to MPU so that we are in control
+	tail=(c->head+c->count)%DBCHANNELSIZE;
+	while (len)
 	{
-		// xputc(*c);
-		if (Buffer_IsFull(&DBbuffer))
-		{
-			// TODO: do handshaking? maybe XON/XOFF?
-			// xputs(PSTR("full\n"));	
-			return c;
-		}
-		else
-			Buffer_StoreElement(&DBbuffer, *c);
+		n=DBCHANNELSIZE-tail;	// Up to the end of the queue. Then wrap round.
+		if (n>len)
+			n=len;
+		SetSerialRamAddress(SPIRAM_WRITE, DBQUEUEBASE+c->base+tail);
+		WriteSerialRam((char*)data,n);
+		DeselectSerialRam();
+		data+=n;
+		len-=n;
+		c->count+=n;
+		tail=0;
 	}
+} // QueueWrite
+
+/** Copy bytes from the front of a channel's queue. They stay in the queue.
+ * \param data : Where to put them
+ * \param len : How many. Must not be more than count.
+ */
+static void QueuePeek(DBCHANNEL *c, uint8_t *data, uint8_t len)
+{
+	uint16_t head=c->head;
+	uint16_t n;
+	PORTC.OUT&=~VBIT_SEL; // Set the mux to MPU so that we are in control
+	while (len)
+	{
+		n=DBCHANNELSIZE-head;
+		if (n>len)
+			n=len;
+		SetSerialRamAddress(SPIRAM_READ, DBQUEUEBASE+c->base+head);
+		ReadSerialRam((char*)data,n);
+		DeselectSerialRam();
+		data+=n;
+		len-=n;
+		head=(head+n)%DBCHANNELSIZE;
+	}
+} // QueuePeek
+
+uint8_t DataBroadcastPut(uint8_t ch, uint8_t *data, uint16_t len)
+{
+	if (len>DBWRITECHUNK || len>DataBroadcastFree(ch))
+		return 1;
+	if (FIFOBusy)
+		return DBBUSY;	// The DENC has the RAM. Try again when it has finished.
+	QueueWrite(&channel[ch],data,len);	// Small enough to finish before the DENC takes the RAM
 	return 0;
-} // putringstring
+} // DataBroadcastPut
 
-void InitDataBroadcast(void)
+/** Smooth weighted round robin.
+ * Every channel with something to send gets its weight added to its credit.
+ * The one with the most credit goes, and pays back the total of the weights.
+ * Over time each channel gets lines in proportion to its weight, and the
+ * goes are spread out, so a busy bulk channel can't hold up a control channel.
+ * A channel that has nothing to send doesn't build up credit.
+ * \return The channel to send, or 0 if there is nothing to send
+ */
+static DBCHANNEL *PickChannel(void)
 {
-	Buffer_Initialize(&DBbuffer);
-}
+	DBCHANNEL *c;
+	DBCHANNEL *best=0;
+	int16_t total=0;
+	for (c=channel;c<&channel[DBCHANNELS];c++)
+	{
+		if (!c->weight || !c->count)
+			continue;
+		c->credit+=c->weight;
+		total+=c->weight;
+		if (!best || c->credit>best->credit)
+			best=c;
+	}
+	if (best)
+		best->credit-=total;
+	return best;
+} // PickChannel
 
 //--------------------------------------------------------
 /** Send databroadcast as packet 8/31 using IDL type A checksums
- * This routine takes data from the ring buffer and places it into a packet.
+ * This routine takes data from the channel queues and places it into a packet.
+ * Explicit continuity and data length are always sent, so a packet can
+ * go out as soon as there is anything to send and the receiver won't see the padding.
+ * If a channel has repeats, each packet is sent that many more times with the RI counting up.
  * \param pkt : pointer to a char buffer that must be at least 45 characters long
- * \return 1 if there is nothing to send, or 0 if there is a valid packet.
- * TODO: Repeats, Datalength. 
+ * \return 1 if there is nothing to send, or 0 if there is a packet ready to go.
  */
 int SendDataBroadcast(char* pkt)
 {
-	int i;
-	// static unsigned char continuity = 0; // TODO
-
-	//xputc('D');
+	DBCHANNEL *c;
+	uint8_t i;
 
+	if (FIFOBusy)
+		return 1;	// Can't get at the queue
 	// Do we have any data to send?
-	if (Buffer_IsEmpty(&DBbuffer))
-	{
+	c=PickChannel();
+	if (!c)
 		return 1;
-	}
-	
+
 	// Assemble the basic packet 8/31
 	// Note that the comment numbers are one higher than the array index. 
 	char* p=pkt;
@@ -66,37 +199,31 @@ int SendDataBroadcast(char* pkt)
 	*(p++)=0x27;						// 3: framing code
 	*(p++)=HamTab[0x08];				// 4: mrag for 8/31. data channel. designation code.
 	*(p++)=HamTab[0x0f];				// 5: DCG
-	//  Need to implement DL
-	*(p++)=HamTab[0];					// 6: FT Format type set to format 1 with implicit continuity and no repeats
-	*(p++)=HamTab[1];					// 7: IAL address length of 1 (IAL)
-	*(p++)=HamTab[9];					// 8: SPA address=9 for SISCom, 8 for BTVC
-	// *(p++)=0x00; //						// 9: no repeat
-	//*(p++)=continuity++;				// 10: continuity indicator
-	// The rest of the packet doesn't need to be filled with dummy values,
-	// except for debugging
-	/*
-	for (i=8;i<43;i++)					// 11-43: 33 payload bytes
-		*(p++)=' ';
-	*(p++)=0xfe;						// 44: Hi checksum
-	*(p++)=0xff;						// 45: Lo checksum
-	*/
-	// initialise the checksum
-	ClearCRC();
-	
-	// insert the payload and set even parity,
-	// and clear out the rest of the packet.
-	// TODO: Add the DL value. This will reduce the overheads
-	for (i=8;i<43;i++)
+	*(p++)=HamTab[FT_CI|FT_DL|(c->repeats?FT_RI:0)];	// 6: FT Format A with explicit continuity and data length
+	*(p++)=HamTab[c->ial];				// 7: IAL address length
+	for (i=0;i<c->ial;i++)
+		*(p++)=HamTab[(uint8_t)c->address[i]];	// 8..: Address. eg. 9 for SISCom, 8 for BTVC
+	if (c->repeats)
+		*(p++)=c->repeat;				// RI repeat indicator
+	*(p++)=c->continuity;				// CI continuity indicator. The same on every repeat.
+	if (!c->repeat)
 	{
-		if (Buffer_IsEmpty(&DBbuffer))
-			pkt[i]=0x80;
-		else
-			pkt[i]=pgm_read_byte(&ParTab[Buffer_GetElement(&DBbuffer)]); 	// What about partial lines? DL!
-		// xputs(PSTR(" char="));
-		// xputc(pkt[i]);
+		c->sending=&pkt[43]-(p+1);		// Room after the DL
+		if (c->sending>c->count)
+			c->sending=c->count;
 	}
-	// Calculate the CRCs 
-	for (i=8;i<43;i++)
+	*(p++)=c->sending;					// DL data length
+	
+	// insert the payload. It is 8 bit data so it goes out as it is, without parity
+	QueuePeek(c,(uint8_t*)p,c->sending);
+	p+=c->sending;
+	// The receiver ignores anything past DL, but fill it in anyway
+	for (;p<&pkt[43];p++)
+		*p=0x80;
+
+	// Calculate the CRC. It covers everything after the address.
+	ClearCRC();
+	for (i=7+c->ial;i<43;i++)
 	{
 		AddCRC(pkt[i]);
 	}
@@ -104,55 +231,15 @@ int SendDataBroadcast(char* pkt)
 	// add it to the end
 	EndPacket(&pkt[43],&pkt[44]);
 
-	// TODO: Repeats
-	
-	return 0;
-}//SendDataBroadcast
-
-// SendOpt14 - Sends a mode 14 start packet
-int SendOpt14(char* pkt)
-{
-// Softel opt-outs have 6 address bytes (24 bit)
-#define AddressLength 6
-	unsigned int i;
-	char* p;
-		
-	WritePrefix(pkt,8,31);	// CRI,FC,MRAG
-	p=&pkt[5];	
-	
-	//  Need to implement DL
-	*(p++)=HamTab[0];					// 6: FT Format type set to format 1 with implicit continuity and no repeats
-	*(p++)=HamTab[AddressLength];		// 7: IAL address length of 6 (IAL)
-	*(p++)=HamTab[0];					// Address 000242 (Eurosport 2)
-	*(p++)=HamTab[0];					// 
-	*(p++)=HamTab[0];					// 
-	*(p++)=HamTab[2];					// 
-	*(p++)=HamTab[4];					// 
-	*(p++)=HamTab[2];					// 
-	*(p++)=HamTab[0];					// Checksum computing starts here.
-	// RI is not included because FT=0
-
-	//1538151515496449155001B0B0B03134B6B0B932B020204332B334B5B920202020D3CDD351E3BF11
-//0 6 0 0 0 2 4 2 0.............. d..............................................
-//  8    I d I  P  0 0 0 1 4 6 0 9 2 0     C 2 3 4 5 9         S M S Q c ? 
-	*(p++)=0x50; 
-	*(p++)=0x01;*(p++)=0xB0;*(p++)=0xB0;*(p++)=0xB0;*(p++)=0x31;	// 15
-	*(p++)=0x34;*(p++)=0xB6;*(p++)=0xB0;*(p++)=0xB9;*(p++)=0x32;	// 20
-	*(p++)=0xB0;*(p++)=0x20;*(p++)=0x20;*(p++)=0x43;*(p++)=0x32;	// 25
-	*(p++)=0xB3;*(p++)=0x34;*(p++)=0xB5;*(p++)=0xB9;*(p++)=0x20;	// 30
-	*(p++)=0x20;*(p++)=0x20;*(p++)=0x20;*(p++)=0xD3;*(p++)=0xCD;	// 35
-	*(p++)=0xD3;*(p++)=0x51;*(p++)=0xE3;*(p++)=0xBF;*(p++)=0x11;	// 40
-	
-	// Calculate the CRCs (Parity is already done on these values)
-	ClearCRC();
-	// Strictly speaking, we should also look at FT and add as required CI, RI, DL.
-	for (i=8+AddressLength;i<43;i++) // Where the count is 7+Address Length. (BTVC=1, Softel trigger=6.)
+	// Last go? Take the data off the queue
+	if (c->repeat++>=c->repeats)
 	{
-		AddCRC(pkt[i]);
+		c->head=(c->head+c->sending)%DBCHANNELSIZE;
+		c->count-=c->sending;
+		c->repeat=0;
+		c->continuity++;
 	}
-	// add it to the end
-	// Oh dear. It doesn't match. Let's not do this at the moment
-	// EndPacket(&pkt[43],&pkt[44]);
 
-	return 0; // TODO. Return something useful?
-} // SendOpt14
+	Parity(pkt,PACKETSIZE);	// Just the bit reverse. The CRC mustn't get parity.
+	return 0;
+}//SendDataBroadcast
@@ -5,6 +5,7 @@
 // C libraries
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 // databroadcast libraries
 #include "xitoa.h"
@@ -13,8 +14,20 @@
 #include "tables.h"
 #include "crca.h" // IDL Format A checksums
 
-// A bit of LUFA
-#include "Lib/RingBuff.h"
+// FT bits for IDL format A
+#define FT_RI	0x02	// Repeat indicator present
+#define FT_CI	0x04	// Explicit continuity indicator present
+#define FT_DL	0x08	// Data length present
+
+// Independent packet 31 channels. Each has its own address and an equal part of the queue.
+#define DBCHANNELS	4
+#define DBCHANNELSIZE	(DBQUEUESIZE/DBCHANNELS)
+// Longest channel setting (aaaaaa,www,rr) and the terminator
+#define DBCHANNELSETTING	14
+// DataBroadcastPut takes no more than this in one go, so that the write finishes before the FIFO is needed
+#define DBWRITECHUNK	64
+// DataBroadcastPut result when the DENC has the serial RAM
+#define DBBUSY	2
 
 // forward declarations
 int copypacket(unsigned char *cmd, unsigned char *pkt);        // copy the packet into an output buffer using escapes and return checksum
@@ -26,18 +39,38 @@ int MakeOffset(int off);
  */
 void InitDataBroadcast(void);
 
-/** Send data from the ring buffer if there is any
+/** Send data from the queue if there is any
+ * \return 0 if pkt is ready to go, 1 if there is nothing to send
  */
 int SendDataBroadcast(char* pkt);
 
-/** Sends a mode 14 Opt Out
+/** Set up a channel
+ * \param ch : Channel 0..DBCHANNELS-1
+ * \param setting : <address>,<weight>,<repeats> eg. 9,1,0
+ * The address is 1 to 6 hex digits. Its length is the IAL.
+ * Lines are shared between the channels that have data in proportion to the weight 1..100. 0 is off.
+ * Each packet is sent again repeats (0..15) more times.
+ * An empty setting turns the channel off.
+ * \return 0 if OK, 1 if the setting is bad
+ */
+uint8_t DataBroadcastConfigure(uint8_t ch, char *setting);
+
+/** \param ch : Channel 0..DBCHANNELS-1
+ * \return Number of bytes that the channel's queue has room for
  */
-int SendOpt14(char* pkt);
+uint16_t DataBroadcastFree(uint8_t ch);
+
+/** Put data on the end of a channel's queue. Don't call it from an interrupt.
+ * \param ch : Channel 0..DBCHANNELS-1
+ * \param data : Bytes to send. All 8 bits go out unchanged.
+ * \param len : Number of bytes. No more than DBWRITECHUNK.
+ * \return 0 if OK, 1 if there isn't room for all of it, DBBUSY if the FIFO is busy.
+ * Nothing is queued unless it returns 0. It doesn't wait, so it is safe from DeferService.
+ */
+uint8_t DataBroadcastPut(uint8_t ch, uint8_t *data, uint16_t len);
 
 
 // WritePrefix is linked from packet.c
 extern void WritePrefix(char *packet, uint8_t mag, uint8_t row);
 
-char* putringstring(char* str);
-
 #endif
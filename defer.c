@@ -0,0 +1,102 @@
+/*****************************************************************************
+ * Description       : Deferred work for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file defer.c
+ * Deferred field and second handlers
+ */
+
+#include <string.h>
+#include "defer.h"
+#include "ring.h"
+
+#define FIELDRECORDSIZE	5	// 4 byte field number, then parity
+
+uint16_t deferOverruns;
+
+// Set up statically because the field interrupt may be running before anything is initialised
+static uint8_t fieldRingBuf[DEFERRINGSIZE];
+static RING fieldRing={fieldRingBuf,DEFERRINGSIZE-1,0,0};
+
+static FIELDHANDLER fieldHandler[DEFERHANDLERS];
+static SECONDHANDLER secondHandler[DEFERHANDLERS];
+static uint8_t fieldHandlers;
+static uint8_t secondHandlers;
+static uint32_t secondField;	// The field at the start of the current second
+
+uint8_t DeferOnField(FIELDHANDLER handler)
+{
+	if (fieldHandlers>=DEFERHANDLERS)
+		return 1;
+	fieldHandler[fieldHandlers++]=handler;
+	return 0;
+} // DeferOnField
+
+uint8_t DeferOnSecond(SECONDHANDLER handler)
+{
+	if (secondHandlers>=DEFERHANDLERS)
+		return 1;
+	secondHandler[secondHandlers++]=handler;
+	return 0;
+} // DeferOnSecond
+
+void DeferField(uint32_t field, uint8_t parity)
+{
+	uint8_t record[FIELDRECORDSIZE];
+	if (RingFree(&fieldRing)<FIELDRECORDSIZE)
+	{
+		deferOverruns++;
+		return;
+	}
+	memcpy(record,&field,4);
+	record[4]=parity;
+	RingPutBulk(&fieldRing,record,FIELDRECORDSIZE);
+} // DeferField
+
+void DeferService(void)
+{
+	uint8_t record[FIELDRECORDSIZE];
+	uint32_t field;
+	uint8_t i;
+	while (RingGetBulk(&fieldRing,record,FIELDRECORDSIZE))
+	{
+		memcpy(&field,record,4);
+		for (i=0;i<fieldHandlers;i++)
+			fieldHandler[i](field,record[4]);
+		// Catch up on every second, even if some of the field records were lost
+		while (field-secondField>=50)
+		{
+			secondField+=50;
+			for (i=0;i<secondHandlers;i++)
+				secondHandler[i](secondField);
+		}
+	}
+} // DeferService
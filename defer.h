@@ -0,0 +1,79 @@
+/*****************************************************************************
+ * Description       : Deferred work for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Work that used to be done in the field interrupt.
+ * The field interrupt only counts the field and puts a record of it (field number
+ * and parity) in a ring. DeferService, called from the main loop, takes the records
+ * out and calls the handlers that have registered for every field or every second.
+ * This keeps the field interrupt short, so the FIFO switch (TCE1_OVF_vect) isn't
+ * held up, and per-second jobs can use anything that the main loop can.
+ * If the main loop gets so far behind that the ring fills, field records are lost
+ * (deferOverruns counts them) but the per-second handlers still get every second.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \brief Deferred field and second handlers
+*/
+#ifndef _DEFER_H_
+#define _DEFER_H_
+
+#include <stdint.h>
+
+#define DEFERHANDLERS	4	// How many of each sort of handler
+#define DEFERRINGSIZE	64	// 12 fields
+
+/** Called once for every field
+ * \param field : The FieldCount of the field
+ * \param parity : 1 on the even field
+ */
+typedef void (*FIELDHANDLER)(uint32_t field, uint8_t parity);
+
+/** Called once every 50 fields
+ * \param field : The FieldCount at the start of the second. It may be a while ago.
+ */
+typedef void (*SECONDHANDLER)(uint32_t field);
+
+extern uint16_t deferOverruns;	/// Field records that didn't fit in the ring
+
+/** Register a handler. Handlers are called in the order that they were registered.
+ * \return 0 if OK, 1 if there is no room
+ */
+uint8_t DeferOnField(FIELDHANDLER handler);
+uint8_t DeferOnSecond(SECONDHANDLER handler);
+
+/** Field interrupt side. Record a field.
+ */
+void DeferField(uint32_t field, uint8_t parity);
+
+/** Main loop side. Run the handlers for any fields that have been recorded.
+ */
+void DeferService(void);
+
+#endif
@@ -77,9 +77,13 @@
  */
  
  #include "displaylist.h"
+ #include "magstream.h"
+ #include "pagestore.h"
+ #include "task.h"
  
  static NODEPTR sFreeList; // FreeList is an index to the DisplayList. It points to the first free node.
  static NODEPTR sDisplayList; // Root of the display list
+ static NODEPTR sDropList; // Deleted and replaced nodes, waiting for DropStep
  
  /* GetNodePtr and SetNodePtr get NODEPTR values from PageArray */
  /** Write nodeptr to slot addr
@@ -185,6 +189,9 @@
  	node.pageindex=0;
 	node.subpage=FREENODE;
 	node.next=sFreeList; // This node points to the rest of the list
+	node.cycle=0;
+	node.flags=0;
+	node.meta.body=0;
 	SetNode(&node,i);	// TODO: Check that i is in range
 	sFreeList=i;		// And the free list now points to this node
  } // ReturnToFreeList
@@ -203,6 +210,9 @@
 	node.pageindex=0;
 	node.next=0;
 	node.subpage=NULLNODE;
+	node.cycle=0;
+	node.flags=0;
+	node.meta.body=0;
 	SetNode(&node,0);
 	for (i=MAXNODES-1;i>=0;i--)
 	{
@@ -221,6 +231,45 @@ xprintf(PSTR("\n\r"));
 xprintf(PSTR("\n\r"));		
  } // MakeFreeList
  
+ /** A step of the drop job. Takes one node off the drop list,
+  * zeroes the size in its pages.idx record so that ScanPageList skips it, and frees it.
+  * \return 0 when the drop list is empty, 1 if there is more to do, TASKWAIT if the page can't be dropped yet
+  */
+ static uint8_t DropStep(void)
+ {
+	DISPLAYNODE node;
+	NODEPTR np=sDropList;
+	if (np==NULLPTR)
+		return 0;
+	if (!PageStoreIsOpen() || PageInUse(np))
+		return TASKWAIT;	// Wait for insert to open the page store or let go of the page
+	GetNode(&node,np);
+	if (PageStoreDropIndex(node.pageindex))
+		xprintf(PSTR("[DropStep] Could not drop ix=%d\n\r"),node.pageindex);
+	sDropList=node.next;
+	ReturnToFreeList(np);
+	return sDropList!=NULLPTR;
+ } // DropStep
+
+ /** Put a page, and any subpages chained to it, on the drop list.
+  *  It must already be unlinked from the PageArray.
+  */
+ static void DropNodes(NODEPTR np)
+ {
+	DISPLAYNODE node;
+	NODEPTR last=np;
+	GetNode(&node,last);
+	while (node.next!=NULLPTR)
+	{
+		last=node.next;
+		GetNode(&node,last);
+	}
+	node.next=sDropList;
+	SetNode(&node,last);
+	sDropList=np;
+	TaskAddJob(DropStep);
+ } // DropNodes
+
  /** Insert a page into the display list
   * \param mag - 1..8
   * \param page - pointer to a page structure.
@@ -242,24 +291,104 @@ xprintf(PSTR("\n\r"));
 	
 	// HACK ALERT
 	// Last page in is the one that is displayed.
-	// WARNING: Multiple pages will cause pointers to be leaked.
+	// The old page goes to the drop list. It keeps its on air state.
 	// This won't work for sub pages.
 	// It needs to be worked on.
 	if (np==NULLPTR || true) // This forces the LAST page to be the one that goes to the output
 	{
 	// TODO: WHAT WE NEED TO DO HERE at the very least, is to reuse the old node if there was one.
 		// Yes!
+		node.flags=0;
+		if (np!=NULLPTR)
+		{
+			GetNode(&node,np);
+			node.flags&=NODEOFFAIR;
+			DropNodes(np);
+		}
 		newnodeptr=NewNode(); // Make a new node
 		SetNodePtr(newnodeptr,cellAddress); // Pop it into the PageArray
 		node.pageindex=ix;			// Construct the node
 		node.subpage=subpage;
 		node.next=NULLPTR;
+		node.cycle=0;				// New content, so it must go out in full
+		node.meta.body=0;			// and be parsed again
 		SetNode(&node,newnodeptr);		
 	}
 	else
 		xprintf(PSTR("[LinkPage] Sorry, carousels are NOT implemented (np=%d)\n\r"),np);
 	xprintf(PSTR("[LinkPage] Exits\n\r"));
  } // LinkPage
+
+ NODEPTR FindPage(uint8_t mag, uint8_t page)
+ {
+	uint16_t cellAddress;
+	mag=(mag-1) & 0x07; // mags are 0 to 7 in this array
+	cellAddress=((mag<<8)+page)*sizeof(NODEPTR);
+	return GetNodePtr(&cellAddress);
+ } // FindPage
+
+ uint8_t PageOnAir(NODEPTR np)
+ {
+	DISPLAYNODE node;
+	GetNode(&node,np);
+	return !(node.flags & NODEOFFAIR);
+ } // PageOnAir
+
+ uint16_t PageRange(uint16_t first, uint16_t last, uint8_t op)
+ {
+	uint16_t addr;
+	uint16_t count=0;
+	NODEPTR np;
+	DISPLAYNODE node;
+	for (addr=first;addr<=last;addr+=sizeof(NODEPTR))
+	{
+		np=GetNodePtr(&addr);
+		if (np==NULLPTR)
+			continue;
+		count++;
+		if (op==RANGEDELETE)
+		{
+			SetNodePtr(NULLPTR,addr);	// Off air now
+			DropNodes(np);				// and out of pages.idx later
+			continue;
+		}
+		for (;np!=NULLPTR;np=node.next)	// The page and its subpages
+		{
+			GetNode(&node,np);
+			if (op==RANGEDISABLE)
+				node.flags|=NODEOFFAIR;
+			else
+				node.flags&=~NODEOFFAIR;
+			SetNode(&node,np);
+		}
+	}
+	return count;
+ } // PageRange
+
+ void MakePageMeta(PAGEMETA *meta, PAGE *page, uint16_t body)
+ {
+	meta->mag=page->mag;
+	meta->page=page->page;
+	meta->subpage=page->subpage;
+	meta->control=page->control;
+	meta->redirect=page->redirect;
+	meta->body=body;
+	meta->time=page->time;
+ } // MakePageMeta
+
+ void SetPageMeta(PAGEMETA *meta)
+ {
+	NODEPTR np;
+	DISPLAYNODE node;
+	if (!meta->body)
+		return;
+	np=FindPage(meta->mag,meta->page);
+	if (np==NULLPTR)
+		return;
+	GetNode(&node,np);
+	node.meta=*meta;
+	SetNode(&node,np);
+ } // SetPageMeta
  
  /** This takes the page.idx list and makes a sorted display list out of it
   * We need to look at all the pages and extract their MPPSS
@@ -275,7 +404,10 @@ xprintf(PSTR("\n\r"));
 	UINT charcount;	
 	PAGE page;
 	PAGE *p=&page;
+	PAGEMETA meta;
 	uint16_t ix;
+	uint16_t body;
+	DWORD fileptr;
 	const unsigned char MAXLINE=80;
 	
 	char line[MAXLINE];
@@ -305,29 +437,65 @@ xprintf(PSTR("\n\r"));
 		return 1;
 	}
 
+	// Record 0 is the header. An index in the old 6 byte format doesn't have one,
+	// and reading it as 10 byte records would give nonsense pages.
+	f_read(&listFIL,&ixRec,PAGEINDEXRECORDSIZE,&charcount);
+	if (charcount!=PAGEINDEXRECORDSIZE || ixRec.seekptr!=PAGEINDEXMAGIC ||
+		ixRec.hash!=PAGEINDEXVERSION || listFIL.fsize%PAGEINDEXRECORDSIZE)
+	{
+		xprintf(PSTR("[displaylist]pages.idx is in an old format. Use the C command to rebuild it\n"));
+		f_close(&listFIL);
+		f_close(&pagefileFIL);
+		return 1;
+	}
+
 	spiram_init();
 	SetSPIRamStatus(SPIRAM_MODE_SEQUENTIAL);
 
 	// For all of the pages in our index...
-	for (ix=0;!f_eof(&listFIL);ix++)
+	for (ix=1;!f_eof(&listFIL);ix++)
 	{
-		f_read(&listFIL,&ixRec,sizeof(ixRec),&charcount);
+		f_read(&listFIL,&ixRec,PAGEINDEXRECORDSIZE,&charcount);
+		if (charcount!=PAGEINDEXRECORDSIZE)
+			break;
+		if (!ixRec.pagesize)
+			continue;	// Deleted or replaced
+		if (ixRec.seekptr+ixRec.pagesize>pagefileFIL.fsize)
+		{
+			xprintf(PSTR("Page ix=%d is past the end of pages.all\n\r"),ix);
+			continue;
+		}
 		// xprintf(PSTR("seek %ld size %d \n\r"),ixRec.seekptr,ixRec.pagesize);
 		// TODO: Use seekptr on page.all and parse the page
 		f_lseek(&pagefileFIL,ixRec.seekptr);	// and set the pointer back to the start
-		// TODO: Extract the M PP SS fields
-		p->mag=9;
-		while (p->mag==9) // TODO: Prevent this from going badly wrong!!!
+		// Extract the M PP SS fields and the rest of the header, down to the first OL
+		ClearPage(p);
+		body=0;
+		while (pagefileFIL.fptr<ixRec.seekptr+ixRec.pagesize)
 		{
+			fileptr=pagefileFIL.fptr;
 			str=f_gets(line,MAXLINE,&pagefileFIL);		
+			if (!str)
+				break;
+			if (str[0]=='O' && str[1]=='L')
+			{
+				body=(uint16_t)(fileptr-ixRec.seekptr);	// Where the rows start
+				break;
+			}
 			// xprintf(PSTR("parsing %s\n\r"),str);
 			ParseLine(p,str);
-			//TODO: Check that we didn't read past the end of this page
+		}
+		if (p->mag>8)
+		{
+			xprintf(PSTR("No PN in page ix=%d\n\r"),ix);
+			continue;
 		}
 		xprintf(PSTR("M PP SS %1d %02X %02d\n\r"),p->mag,p->page,p->subpage);
 		// TODO: Find or create the root of the mag M 
 		// Something like 
 		LinkPage(p->mag,p->page,p->subpage,ix);
+		MakePageMeta(&meta,p,body);
+		SetPageMeta(&meta);	// So the directory and insert don't have to parse it again
 		xprintf(PSTR("next iteration\n\r"));
 	}
 	f_close(&listFIL);
@@ -347,6 +515,7 @@ xprintf(PSTR("\n\r"));
 	
 	sDisplayList=NULLPTR;
 	sFreeList=NULLPTR;
+	sDropList=NULLPTR;
 	// Put all the slots into the free list
 	MakeFreeList();
 	Dump();
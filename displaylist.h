@@ -40,8 +40,23 @@ typedef struct
 {
 	uint32_t seekptr;	// This is the pointer to the start of a page
 	uint16_t pagesize;  // And the number of bytes in the page
+	uint32_t hash;		// PageHash of the page, so that unchanged pages don't get uploaded again
 } PAGEINDEXRECORD;
 
+/** What insert needs to know about a page, so that it doesn't have to
+ * parse the page file on every repeat. Filled in the first time the page goes out.
+ */
+typedef struct
+{
+uint8_t mag;		// 1..8
+uint8_t page;		// 0x00..0xff
+uint8_t subpage;	// As parsed from PN
+uint16_t control;	// PS
+uint8_t redirect;	// RD or 0xff
+uint16_t body;		// Offset of the first OL line from the start of the page. 0 if not cached yet.
+uint16_t time;		// CT cycle time, for the directory
+} PAGEMETA;
+
 /** defines a display list node. However...
  * This is only used to sort subpages.
  * The actual mag and page are in PageArray
@@ -56,8 +71,14 @@ NODEPTR next;
 // uint8_t page;	// Page number 0x00 to 0xff
 uint8_t subpage; // 00 to 99 (not part of teletext standard).
 // Value of subpage also defines the node type. N=00..99, R=100, J=101, F=102   
+uint8_t cycle; // Transmissions since the last full one (row-delta mode, see magstream.c)
+uint8_t flags; // NODEOFFAIR
+PAGEMETA meta; // Parsed page header lines
 } DISPLAYNODE; 
 
+// flags
+#define NODEOFFAIR 0x01	// Disabled. The streamers skip it. Kept when the page is replaced.
+
 // extra subpage values
 #define ROOTNODE 100
 #define JUNCTIONNODE 101
@@ -86,10 +107,10 @@ The data is in two parts, a big index
 * So PageArray is 0x0000 to 0x1000 (16 bit index)
 *
 * The maximum number of nodes that can fit in the PageList are:
-* (0x8000-0x1000)/2=0x1666 or 5734
+* (0x8000-0x1000)/17=1686 (a node is 17 bytes)
 */
 
-// Should be array size 4096 and node count 5734
+// Should be array size 4096 and node count 1686
 // PAGEARRAY is the lower 4k words of the serial ram
 #define PAGEARRAYSIZE (8 * 256 * sizeof (NODEPTR))
 // Nodes are in the remainder of the serial ram
@@ -108,15 +129,55 @@ node address = (node * sizeof(node)) + PAGEARRAYSIZE
 */
 uint8_t InitDisplayList(void);
 // ??void AddPage(??,??);
-// uint8_t DeleteRange(char *range);
+
+// Operations for PageRange
+#define RANGEENABLE 0
+#define RANGEDISABLE 1
+#define RANGEDELETE 2
+
+/** Enable, disable or delete every page in a range of the page array, in one pass.
+ * Only the serial ram is touched, so it takes effect at once.
+ * Deleted pages go on a drop list. A background job takes them out of pages.idx
+ * (so that they don't come back at the next restart) and then frees their nodes.
+ * \param first : Page array address of the first page (as pageFilterToArray)
+ * \param last : Page array address of the last page
+ * \param op : RANGEENABLE, RANGEDISABLE or RANGEDELETE
+ * \return The number of pages that were found
+ */
+uint16_t PageRange(uint16_t first, uint16_t last, uint8_t op);
+
+/** \return 0 if the page has been disabled, 1 if it may go out
+ */
+uint8_t PageOnAir(NODEPTR np);
 
 NODEPTR GetNodePtr(uint16_t *addr);
 void GetNode(DISPLAYNODE *node,NODEPTR i);
+void SetNode(DISPLAYNODE *node, NODEPTR i);
 void DumpNode(NODEPTR np);
 
 /** Given a newly added page appended to page.all and page.idx
  *  constructs the page index and node so that it can be displayed
  */
 void LinkPage(uint8_t mag, uint8_t page, uint8_t subpage, uint16_t ix);
+
+/** \param mag : 1..8
+ * \param page : 0x00..0xff
+ * \return The node of the page that is on air, or NULLPTR if there isn't one
+ */
+NODEPTR FindPage(uint8_t mag, uint8_t page);
+
+/** Copy the header details of a page into a PAGEMETA
+ * \param meta : Returns the details
+ * \param page : The page, parsed down to the first OL line
+ * \param body : Offset of the first OL line from the start of the page
+ */
+void MakePageMeta(PAGEMETA *meta, PAGE *page, uint16_t body);
+
+/** Put the parsed header details of a page in its node, so that nothing
+ * (insert, the directory commands) needs to parse the page file for them.
+ * Call after LinkPage.
+ * \param meta : mag and page say which page. Nothing is done if body is 0.
+ */
+void SetPageMeta(PAGEMETA *meta);
  
 #endif
\ No newline at end of file
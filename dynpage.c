@@ -0,0 +1,167 @@
+/*****************************************************************************
+ * Description       : Dynamic pages (RD) for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Dynamic pages play out straight from the serial RAM instead of the SD card.
+ * They are loaded a row at a time by JA/JW.
+ *
+ * Each page has two copies of every row. A row is sent from its front copy
+ * and JW always writes the back copy. The front/back choice for each row is
+ * a bit in a mask, so swapping is just flipping the bits of the rows that
+ * were written. insert does this at the start of the page, so a page never
+ * goes out half old and half new.
+ *
+ * The serial RAM belongs to the DENC while FIFOBusy is set, so JW packets
+ * are queued here and FillFIFO writes them when it has the RAM.
+ * Rows that have never been written are not sent at all.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file dynpage.c
+ * Double buffered dynamic pages
+ */
+
+#include "dynpage.h"
+
+typedef struct
+{
+	uint32_t front;		// Bit n set if row n+1 is in the second copy
+	uint32_t written;	// Rows whose back copy is new
+	uint32_t valid;		// Rows that have ever been written
+	uint32_t changed;	// Rows swapped in since the last full transmission
+	uint32_t send;		// Rows to send this time
+} DYNPAGE;
+
+typedef struct
+{
+	uint8_t page;		// 0xff for a raw write
+	uint8_t row;
+	uint16_t address;
+	char packet[PACKETSIZE];
+} DYNPAGEWRITE;
+
+static DYNPAGE dynPage[SRAMPAGECOUNT];
+static DYNPAGEWRITE dynQueue[DYNPAGEQUEUESIZE];
+static uint8_t dynQueueCount;
+
+/** \return Serial RAM address of one copy of a row
+ */
+static uint16_t RowAddress(uint8_t page, uint8_t row, uint8_t copy)
+{
+	return SRAMPAGEBASE+(page*SRAMPAGEBUFFERS+copy)*SRAMPAGESIZE+(row-1)*PACKETSIZE;
+} // RowAddress
+
+uint16_t DynPageRowAddress(uint8_t page, uint8_t row)
+{
+	return RowAddress(page,row,(dynPage[page].front>>(row-1))&1);
+} // DynPageRowAddress
+
+uint8_t DynPageWrite(uint8_t page, uint8_t row, char *packet)
+{
+	DYNPAGEWRITE *w;
+	if (page>=SRAMPAGECOUNT || row<1 || row>SRAMPAGEPACKETS || dynQueueCount>=DYNPAGEQUEUESIZE)
+		return 1;
+	w=&dynQueue[dynQueueCount];
+	w->page=page;
+	w->row=row;
+	memcpy(w->packet,packet,PACKETSIZE);
+	dynQueueCount++;
+	return 0;
+} // DynPageWrite
+
+uint8_t DynPageWriteRaw(uint16_t address, char *packet)
+{
+	DYNPAGEWRITE *w;
+	if (dynQueueCount>=DYNPAGEQUEUESIZE)
+		return 1;
+	w=&dynQueue[dynQueueCount];
+	w->page=0xff;
+	w->address=address;
+	memcpy(w->packet,packet,PACKETSIZE);
+	dynQueueCount++;
+	return 0;
+} // DynPageWriteRaw
+
+void DynPageFlush(void)
+{
+	uint8_t i;
+	uint32_t bit;
+	DYNPAGEWRITE *w;
+	DYNPAGE *p;
+	if (!dynQueueCount)
+		return;
+	PORTC.OUT&=~VBIT_SEL; // Set the mux to MPU so that we are in control
+	for (i=0;i<dynQueueCount;i++)
+	{
+		if (FIFOBusy)
+			break;	// The DENC wants it back. Do the rest next time.
+		w=&dynQueue[i];
+		if (w->page==0xff)
+			SetSerialRamAddress(SPIRAM_WRITE, w->address);
+		else
+		{
+			// Always the back copy, so the row on air is never touched
+			p=&dynPage[w->page];
+			bit=(uint32_t)1<<(w->row-1);
+			SetSerialRamAddress(SPIRAM_WRITE, RowAddress(w->page,w->row,(p->front & bit)?0:1));
+			p->written|=bit;
+			p->valid|=bit;
+		}
+		WriteSerialRam(w->packet,PACKETSIZE);
+		DeselectSerialRam();
+	}
+	// Shuffle down anything that we didn't get to
+	dynQueueCount-=i;
+	if (dynQueueCount)
+		memmove(dynQueue,&dynQueue[i],dynQueueCount*sizeof(DYNPAGEWRITE));
+} // DynPageFlush
+
+void DynPageSwap(uint8_t page, uint8_t delta)
+{
+	DYNPAGE *p=&dynPage[page];
+	p->front^=p->written;
+	p->changed|=p->written;
+	p->written=0;
+	if (delta)
+		p->send=p->changed;
+	else
+	{
+		p->send=p->valid;
+		p->changed=0;
+	}
+} // DynPageSwap
+
+uint8_t DynPageNextRow(uint8_t page, uint8_t row)
+{
+	uint32_t send=dynPage[page].send;
+	for (;row<=SRAMPAGEPACKETS;row++)
+		if (send & ((uint32_t)1<<(row-1)))
+			return row;
+	return DYNPAGE_END;
+} // DynPageNextRow
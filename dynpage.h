@@ -0,0 +1,96 @@
+/*****************************************************************************
+ * Description       : Dynamic pages (RD) for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Dynamic pages play out straight from the serial RAM instead of the SD card.
+ * They are loaded a row at a time by JA/JW.
+ *
+ * Each page has two copies of every row. A row is sent from its front copy
+ * and JW always writes the back copy. The front/back choice for each row is
+ * a bit in a mask, so swapping is just flipping the bits of the rows that
+ * were written. insert does this at the start of the page, so a page never
+ * goes out half old and half new.
+ *
+ * The serial RAM belongs to the DENC while FIFOBusy is set, so JW packets
+ * are queued here and FillFIFO writes them when it has the RAM.
+ * Rows that have never been written are not sent at all.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \brief Double buffered dynamic pages
+*/
+#ifndef _DYNPAGE_H_
+#define _DYNPAGE_H_
+
+#include "avr_compiler.h"
+#include <avr/pgmspace.h>
+#include "xitoa.h"
+#include "vbit.h"
+
+/// How many JW packets can wait for the serial RAM
+#define DYNPAGEQUEUESIZE 4
+
+/// Returned by DynPageNextRow when there are no more rows
+#define DYNPAGE_END 0xff
+
+/** Queue a row for a dynamic page. It goes on air at the next page boundary.
+ * \param page : 0..SRAMPAGECOUNT-1
+ * \param row : 1..SRAMPAGEPACKETS
+ * \param packet : 45 byte packet, not yet encoded
+ * \return 0 if OK, 1 if the page/row is bad or the queue is full
+ */
+uint8_t DynPageWrite(uint8_t page, uint8_t row, char *packet);
+
+/** Queue a packet to a raw serial RAM address (JZ)
+ * \return 0 if OK, 1 if the queue is full
+ */
+uint8_t DynPageWriteRaw(uint16_t address, char *packet);
+
+/** Write any queued packets to the serial RAM. Only call this when we own the RAM.
+ */
+void DynPageFlush(void);
+
+/** Put rows written since the last swap on air. Call at the start of the page.
+ * \param page : 0..SRAMPAGECOUNT-1
+ * \param delta : 0 to send every row, 1 to only send rows changed since the last full transmission
+ */
+void DynPageSwap(uint8_t page, uint8_t delta);
+
+/** Find the next row to send
+ * \param page : 0..SRAMPAGECOUNT-1
+ * \param row : Row to start looking from
+ * \return Row number or DYNPAGE_END
+ */
+uint8_t DynPageNextRow(uint8_t page, uint8_t row);
+
+/** \return Serial RAM address of the front copy of a row
+ */
+uint16_t DynPageRowAddress(uint8_t page, uint8_t row);
+
+#endif
@@ -0,0 +1,224 @@
+/*****************************************************************************
+ * Description       : Pre-encoded Fastext links for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * The FL line of a tti page gives the six Fastext links (red, green, yellow,
+ * cyan, index and the link control page) as mpp numbers.
+ * When a page is stored, FastextLine sees every line of it. It holds back the
+ * FL line and works out the page CRC of the rows as they go past.
+ * FastextEnd then writes an FX line: the X/27/0 packet as 38 hex nibbles
+ * (designation code, six links with relative magazine bits, link control)
+ * followed by the CRC of the rows. The FL line goes after it, so the links
+ * can still be read back.
+ *
+ * On air, FastextPacket only has to ham the nibbles and add the header's part
+ * of the CRC. The CRC is linear, so that is a table lookup per header CRC bit,
+ * not a pass over the page.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file fastext.c
+ * Fastext X/27/0 packets and the page CRC
+ */
+
+#include "fastext.h"
+#include "packet.h"
+#include "tables.h"
+
+// Number of hex digits in an FX line before the CRC
+#define FXNIBBLES 38
+
+/** Page CRC (ETSI EN 300 706 9.6.1). The generator is x^16+x^12+x^9+x^7+1.
+ * The CRC is linear, so the CRC of header+rows is the header CRC moved on by the
+ * 1000 row characters, xored with the CRC of the rows alone.
+ * Entry i is the CRC that you get from 1<<i followed by 1000 nulls.
+ */
+static const uint16_t PageCRCShift[16] PROGMEM = {
+	0xE65F, 0xCCBE, 0x997C, 0x32F8, 0x65F1, 0xCBE2, 0x97C4, 0xC9D6,
+	0x93AC, 0xC107, 0x820E, 0x041D, 0xEE65, 0xDCCB, 0xB997, 0x732F
+};
+
+static uint16_t links[6];		// Page numbers from the FL line
+static uint8_t haveLinks;		// The FL line has been held back
+static uint16_t rowCRC;			// Page CRC of the rows so far
+static uint8_t lastRow;			// The last row in rowCRC
+static uint8_t crcValid;		// Cleared if rows come out of order
+
+uint16_t PageCRCByte(uint16_t crc, uint8_t ch)
+{
+	uint8_t i;
+	uint8_t in;
+	ch&=0x7f;	// No parity
+	for (i=0;i<8;i++)
+	{
+		in=((ch>>7)^(crc>>6)^(crc>>8)^(crc>>11)^(crc>>15))&1;
+		crc=(crc<<1)|in;
+		ch<<=1;
+	}
+	return crc;
+} // PageCRCByte
+
+/** Rows that aren't in the page are counted as spaces
+ */
+static void BlankRowCRC(void)
+{
+	uint8_t i;
+	for (i=0;i<40;i++)
+		rowCRC=PageCRCByte(rowCRC,' ');
+} // BlankRowCRC
+
+static uint8_t HexNibble(char ch)
+{
+	if (ch<='9')
+		return ch-'0';
+	return (ch&0x5f)-'A'+10;
+} // HexNibble
+
+void FastextBegin(void)
+{
+	haveLinks=0;
+	rowCRC=0;
+	lastRow=0;
+	crcValid=1;
+} // FastextBegin
+
+/** FL,<link red>,<link green>,<link yellow,<link cyan>,<link>,<link index>
+ * Unlike copyFL this doesn't write on the line, it might be going to pages.all after this.
+ * \return 0 if all six links were found
+ */
+static uint8_t ParseLinks(char *line)
+{
+	uint8_t i;
+	uint16_t n;
+	line+=2;
+	for (i=0;i<6;i++)
+	{
+		if (*line++!=',')
+			return 1;
+		for (n=0;isxdigit(*line);line++)
+			n=(n<<4)+HexNibble(*line);
+		links[i]=n;
+	}
+	return 0;
+} // ParseLinks
+
+uint8_t FastextLine(char *line)
+{
+	char packet[PACKETSIZE];
+	uint8_t row;
+	uint8_t i;
+	if (line[0]=='F' && line[1]=='L')
+	{
+		haveLinks=!ParseLinks(line);
+		return haveLinks;
+	}
+	if (line[0]!='O' || line[1]!='L')
+		return 0;
+	row=copyOL(packet,line,strlen(line));
+	if (row<1 || row>25)
+		return 0;	// Not a display row (or a bad line)
+	if (row<=lastRow)
+	{
+		crcValid=0;	// The rows have to go into the CRC in order. Not worth sorting them.
+		return 0;
+	}
+	while (++lastRow<row)
+		BlankRowCRC();
+	for (i=5;i<PACKETSIZE;i++)
+		rowCRC=PageCRCByte(rowCRC,packet[i]);
+	return 0;
+} // FastextLine
+
+void FastextEnd(char *buf, uint8_t mag)
+{
+	static const char hex[]="0123456789ABCDEF";
+	char *p=buf;
+	uint8_t i;
+	uint8_t rel;
+	*p=0;
+	if (!haveLinks)
+		return;
+	haveLinks=0;	// Only once
+	if (crcValid)
+	{
+		while (lastRow++<25)
+			BlankRowCRC();
+		*p++='F';*p++='X';*p++=',';
+		*p++='0';	// Designation code
+		for (i=0;i<6;i++)
+		{
+			rel=(links[i]>>8)^mag;	// The magazine is relative to this page
+			*p++=hex[links[i] & 0x0f];	// page units
+			*p++=hex[(links[i]>>4) & 0x0f];	// page tens
+			*p++='F';						// subcode S1
+			*p++=hex[((rel & 1) << 3) | 7];
+			*p++='F';
+			*p++=hex[((rel & 6) << 1) | 3];
+		}
+		*p++='F';	// Link control
+		for (i=0;i<4;i++)
+			*p++=hex[(rowCRC>>(12-4*i)) & 0x0f];
+		*p++='\n';
+	}
+	sprintf(p,"FL,%03x,%03x,%03x,%03x,%03x,%03x\n",
+		links[0],links[1],links[2],links[3],links[4],links[5]);
+} // FastextEnd
+
+uint8_t FastextPacket(char *packet, char *line, uint8_t length, uint16_t headercrc)
+{
+	char *p=packet+5;
+	uint8_t i;
+	uint16_t crc=0;
+	if (length<3+FXNIBBLES+4)
+		return 1;
+	line+=3;
+	for (i=0;i<FXNIBBLES;i++)
+		*p++=HamTab[HexNibble(*line++)];
+	for (i=0;i<4;i++)
+		crc=(crc<<4)|HexNibble(*line++);
+	// Move the header CRC on past the rows
+	for (i=0;i<16;i++,headercrc>>=1)
+		if (headercrc & 1)
+			crc^=pgm_read_word(&PageCRCShift[i]);
+	*p++=crc>>8;	// These two are not hammed
+	*p=crc;
+	return 0;
+} // FastextPacket
+
+void FastextLinks(char *line, uint8_t mag, uint16_t *links)
+{
+	uint8_t i;
+	uint8_t rel;
+	line+=4;	// FX, and the designation code
+	for (i=0;i<4;i++,line+=6)
+	{
+		rel=((HexNibble(line[3])>>3) & 1) | ((HexNibble(line[5])>>1) & 6);
+		links[i]=((uint16_t)((rel^mag) & 7)<<8) | (HexNibble(line[1])<<4) | HexNibble(line[0]);
+	}
+} // FastextLinks
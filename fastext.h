@@ -0,0 +1,91 @@
+/*****************************************************************************
+ * Description       : Pre-encoded Fastext links for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * copyFL used to turn the FL line into an X/27/0 packet every time the page went out.
+ * Now the packet is worked out once, when the page is uploaded (ea/ee) or imported
+ * (SDCreateLists), and stored in pages.all as an FX line just before the FL line.
+ * FX,<38 hex nibbles><4 hex digits>
+ * The nibbles are bytes 5 to 42 of the packet before Hamming (designation code,
+ * six links, link control). The last four digits are the page CRC of rows 1 to 25.
+ * The header is the only part of the page CRC that isn't known until transmission,
+ * so insert adds it when the packet goes out. Pages without an FX line still use copyFL.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \brief Fastext X/27/0 packets and the page CRC
+*/
+#ifndef _FASTEXT_H_
+#define _FASTEXT_H_
+
+#include <stdint.h>
+
+/** Add a character to a page CRC. Parity is not included.
+ * \param crc : CRC so far. Start at 0.
+ * \param ch : Character
+ * \return The new CRC
+ */
+uint16_t PageCRCByte(uint16_t crc, uint8_t ch);
+
+/** Start building the FX line for a new page
+ */
+void FastextBegin(void);
+
+/** Pass every line of the page to this, in file order, before it is written to pages.all
+ * \param line : tti line. It is not changed.
+ * \return 1 if the line was a good FL line. Don't write it, FastextEnd writes it after the FX line.
+ */
+uint8_t FastextLine(char *line);
+
+// Room for the FX and FL lines from FastextEnd
+#define FASTEXTENDSIZE 84
+
+/** Make the FX and FL lines that go at the end of the page
+ * \param buf : FASTEXTENDSIZE chars. Returns the lines, or "" if there are no links.
+ * \param mag : Magazine of the page 1..8
+ */
+void FastextEnd(char *buf, uint8_t mag);
+
+/** Make an X/27/0 packet from an FX line. The caller adds the prefix.
+ * \param packet : Packet to fill in from byte 5. The CRC bytes are not to be given parity.
+ * \param line : FX line. It might not be null terminated.
+ * \param length : Length of line
+ * \param headercrc : PageCRCByte of the 24 caption characters of the header that went out
+ * \return 0 if OK, 1 if the line is bad
+ */
+uint8_t FastextPacket(char *packet, char *line, uint8_t length, uint16_t headercrc);
+
+/** Get the colour key links back out of an FX line that FastextPacket has accepted
+ * \param line : FX line
+ * \param mag : Magazine of the page 1..8
+ * \param links : Returns four page numbers mpp. Mag 8 comes back as 0.
+ */
+void FastextLinks(char *line, uint8_t mag, uint16_t *links);
+
+#endif
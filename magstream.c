@@ -36,12 +36,218 @@
  */
 
 #include "magstream.h"
+#include "pagestore.h"
 
 static uint8_t MagPriority[8]; // 0..9.
 static uint8_t MagLevel[8];		// 0..9
 
 static uint8_t MagPtr[8];
 
+// Urgent pages. JT and freshly uploaded pages jump the queue.
+// A page goes out in the next slot, then gets URGENTREPEATS more goes
+// every URGENTSPACING pages before it goes back to the normal walk.
+#define URGENTQUEUESIZE 8
+#define URGENTREPEATS 3
+#define URGENTSPACING 4
+typedef struct
+{
+	uint8_t mag;		// 1..8
+	uint8_t page;		// 0x00..0xff
+	uint8_t repeats;	// Goes left after this one
+	uint8_t wait;		// Pages to let past before the next go
+} URGENTPAGE;
+static URGENTPAGE UrgentQueue[URGENTQUEUESIZE];
+static uint8_t UrgentCount;
+static uint8_t UrgentLast;	// Set if GetNextPage last returned an urgent page
+static NODEPTR PageNode=NULLPTR;	// What GetPage last handed to insert
+
+/* Row-delta repeats
+A static page doesn't change between edits, but every repeat sends all of it.
+With DeltaCycle=n a page goes out in full (C4 as set by the page) once every n cycles.
+The other repeats are the header with C4 clear, plus for RD pages any rows
+written since the last full transmission. Editing a page makes a new node, so
+a changed page always goes out in full next time.
+We don't need row hashes for the SD pages because pages.all is never written over.
+
+The catch is that a decoder that has just tuned in has to wait for a full one.
+Say a magazine has 100 pages of header, 18 rows and X/27, on 17/18 line fields.
+A full page costs about 35 lines, because insert sends quiet lines after the header
+until the field changes. A delta with no rows doesn't wait for the field (see
+STATE_HEADER in insert), so it costs 2 lines (header and a quiet line).
+These are from a line by line model of insert:
+
+  n   lines/cycle   cycle   first look (mean)   first look (worst)
+  1      3500       1.00         0.50                1.00
+  2      1850       0.53         0.53                1.06
+  4      1020       0.29         0.59                1.17
+  8       610       0.18         0.70                1.40
+
+(times relative to the normal cycle). n=2 about halves the cycle, which is what
+a viewer waiting for an update sees, and costs a new viewer about 6%.
+If deltas waited for the field like full pages, a delta would cost about a field
+and n=2 would only get the cycle down to about 0.75.
+*/
+static uint8_t DeltaCycle;
+
+void SetDeltaCycle(uint8_t n)
+{
+	DeltaCycle=(n>1)?n:0;
+} // SetDeltaCycle
+
+/* Fastext prefetch
+After a page with Fastext links goes out, the viewer will most likely press one of
+the colour keys next. BoostPage puts the linked pages on a short list for their
+magazine and MagStreamer sends them ahead of the normal walk.
+So that the normal cycle keeps going, a magazine sends no more than one boosted page
+in every BoostSpacing+1 of its slots, and a page that the walk gets to within the next
+BOOSTNEAR page numbers is left for the walk. The lists are indexed the same way as
+the page array rows, like the urgent queue.
+*/
+#define BOOSTLISTSIZE 4		// Per magazine. One for each colour key.
+#define BOOSTNEAR 8
+static uint8_t BoostList[8][BOOSTLISTSIZE];
+static uint8_t BoostCount[8];
+static uint8_t BoostWait[8];	// Slots before the mag can send another boosted page
+static uint8_t BoostSpacing;	// 0 is off
+
+void SetFastextBoost(uint8_t n)
+{
+	uint8_t i;
+	BoostSpacing=n;
+	for (i=0;i<8;i++)
+	{
+		BoostCount[i]=0;
+		BoostWait[i]=0;
+	}
+} // SetFastextBoost
+
+void BoostPage(uint8_t mag, uint8_t page)
+{
+	uint8_t i;
+	uint8_t *list;
+	if (!BoostSpacing || page==0xff || mag>8)	// xFF is "no page"
+		return;
+	mag=(mag-1)&0x07;	// Mag 8 can also be 0
+	if ((uint8_t)(page-MagPtr[mag])<BOOSTNEAR)
+		return;	// It is nearly due anyway
+	list=BoostList[mag];
+	for (i=0;i<BoostCount[mag];i++)
+		if (list[i]==page)
+			return;
+	// Full? The newest links are the ones that matter, so lose the oldest
+	if (BoostCount[mag]>=BOOSTLISTSIZE)
+	{
+		for (i=1;i<BOOSTLISTSIZE;i++)
+			list[i-1]=list[i];
+		BoostCount[mag]--;
+	}
+	list[BoostCount[mag]++]=page;
+} // BoostPage
+
+/** BoostStreamer. Take the next boosted page for a magazine, if it may have one now.
+ * Every call is one slot of this magazine.
+ * \param mag - Page array row 0..7
+ * \return NODEPTR to the page, or NULLPTR to carry on with the normal walk
+ */
+static NODEPTR BoostStreamer(uint8_t mag)
+{
+	uint8_t i;
+	uint8_t page;
+	uint16_t cellAddress;
+	NODEPTR np;
+	uint8_t *list=BoostList[mag];
+	if (BoostWait[mag])
+	{
+		BoostWait[mag]--;
+		return NULLPTR;
+	}
+	while (BoostCount[mag])
+	{
+		page=list[0];
+		BoostCount[mag]--;
+		for (i=0;i<BoostCount[mag];i++)
+			list[i]=list[i+1];
+		if ((uint8_t)(page-MagPtr[mag])<BOOSTNEAR)
+			continue;	// The walk caught up with it
+		cellAddress=((mag<<8)+page)*sizeof(NODEPTR);
+		np=GetNodePtr(&cellAddress);
+		if (np!=NULLPTR && PageOnAir(np))
+		{
+			BoostWait[mag]=BoostSpacing;
+			return np;
+		}
+	}
+	return NULLPTR;
+} // BoostStreamer
+
+uint8_t UrgentPage(uint8_t mag, uint8_t page)
+{
+	uint8_t i;
+	if (mag<1 || mag>8)
+		return 1;
+	// Already queued? Then start it again from the top.
+	for (i=0;i<UrgentCount;i++)
+		if (UrgentQueue[i].mag==mag && UrgentQueue[i].page==page)
+			break;
+	if (i==UrgentCount)
+	{
+		if (UrgentCount>=URGENTQUEUESIZE)
+			return 1;
+		UrgentCount++;
+	}
+	UrgentQueue[i].mag=mag;
+	UrgentQueue[i].page=page;
+	UrgentQueue[i].repeats=URGENTREPEATS;
+	UrgentQueue[i].wait=0;
+	return 0;
+} // UrgentPage
+
+static void UrgentRemove(uint8_t i)
+{
+	UrgentCount--;
+	for (;i<UrgentCount;i++)
+		UrgentQueue[i]=UrgentQueue[i+1];
+} // UrgentRemove
+
+/** UrgentStreamer. Find a page from the urgent queue that is due now
+ * Every call is one page slot, so it also counts down the waits.
+ * \param mask - Which mags we may choose from
+ * \return NODEPTR to the page, or NULLPTR if nothing is due
+ */
+static NODEPTR UrgentStreamer(MAGMASK mask)
+{
+	uint8_t i;
+	uint16_t cellAddress;
+	NODEPTR np;
+	URGENTPAGE *u;
+	for (i=0;i<UrgentCount;i++)
+		if (UrgentQueue[i].wait)
+			UrgentQueue[i].wait--;
+	for (i=0;i<UrgentCount;)
+	{
+		u=&UrgentQueue[i];
+		if (u->wait || !(mask & (1<<((u->mag-1)&0x07))))
+		{
+			i++;
+			continue;
+		}
+		cellAddress=((((u->mag-1) & 0x07)<<8)+u->page)*sizeof(NODEPTR);	// Same as LinkPage
+		np=GetNodePtr(&cellAddress);
+		if (np!=NULLPTR && !PageOnAir(np))
+			np=NULLPTR;	// Disabled. Drop it like a deleted page.
+		if (np==NULLPTR || !u->repeats)
+			UrgentRemove(i);	// Page has gone, or this is its last go
+		else
+		{
+			u->repeats--;
+			u->wait=URGENTSPACING;
+		}
+		if (np!=NULLPTR)
+			return np;
+	}
+	return NULLPTR;
+} // UrgentStreamer
+
 /** MagStreamer. Find the next page from this magazine 
  * \param mag - Magazine number
  * \return NODEPTR to the next page, or NULL
@@ -54,6 +260,9 @@ static NODEPTR MagStreamer(uint8_t mag)
 	// xprintf(PSTR("[MagStreamer] Enters looking for the next page in mag %d\n\r"),mag);
 	// Pointer to the last transmitted page;
 	mag&=0x07;	// Wrap mag 8
+	np=BoostStreamer(mag);
+	if (np!=NULLPTR)
+		return np;	// Doesn't move MagPtr. The walk carries on where it was.
 	pagestart=MagPtr[mag];
 	MagPtr[mag]++;
 	// Iterate through this magazine looking for a page.
@@ -63,7 +272,7 @@ static NODEPTR MagStreamer(uint8_t mag)
 		page=MagPtr[mag];
 		cellAddress=(((mag & 0x07)<<8)+page)*sizeof(NODEPTR);
 		np=GetNodePtr(&cellAddress);
-		if (np==NULLPTR)
+		if (np==NULLPTR || !PageOnAir(np))
 			MagPtr[mag]++;	// Iterate through this mag
 		else
 		{
@@ -127,6 +336,11 @@ NODEPTR GetNextPage(MAGMASK mask)
 	uint8_t mag;
 	NODEPTR node;
 	//xprintf(PSTR("[GetNextPage] Enters\n\r"));
+	// Urgent pages come first
+	node=UrgentStreamer(mask);
+	UrgentLast=(node!=NULLPTR);
+	if (UrgentLast)
+		return node;
 	// Get the mag number
 	if (mask)
 		mag=MagPrioritiser(mask);
@@ -148,40 +362,47 @@ NODEPTR GetNextPage(MAGMASK mask)
  * \param pageptr - a DWORD for the seek address
  * \param pagesize - a DWORD for the page size
  * \param mask - a bitmask indicating any mags from which we do not want a page
+ * \param control - returns extra control bits to send with the page (C8 for urgent pages)
+ * \param node - returns the node pointer so that insert can use the cached page details
  */
-uint8_t GetPage(uint32_t *pageptr,uint32_t *pagesize, MAGMASK mask)
+uint8_t GetPage(uint32_t *pageptr,uint32_t *pagesize, MAGMASK mask, uint16_t *control, NODEPTR *nodeptr)
 {
-	FRESULT res;
-	static uint8_t opened=0;
+	uint8_t res;
 	NODEPTR np;
-	uint16_t charcount;	
 	DISPLAYNODE node;
-	PAGEINDEXRECORD ixRec;	
+	uint16_t size;
 	np=GetNextPage(mask); // This is the node pointer of the next page to go out
+	*nodeptr=np;
+	PageNode=np;
 	GetNode(&node,np);	// And this is the node contents of the page
-	// We don't need to keep opening the file, it should be opened once only.
-	if (!opened)
+	// Now we know the page index, lets fetch the index record
+	// (The page store is opened once, by insert, before it gets here)
+	res=PageStoreGetIndex(node.pageindex,pageptr,&size);
+	if (res)
 	{
-		res=f_open(&listFIL,"pages.idx",FA_READ);
-		if (res) // GetPage
-		{
-			xprintf(PSTR("[displaylist]Epic Fail. Can not open pages.idx\n"));			
-			put_rc(res);
-			// At this point we might try to create page.all and pages.idx
-			return res;	
-		}
-		opened=1;
+		xprintf(PSTR("[GetPage]Epic Fail. Can not read pages.idx\n"));
+		return res;
+	}
+	*pagesize=size;
+	*control=UrgentLast?CTRL_C8_UPDATE_bm:0;
+	if (DeltaCycle && np!=NULLPTR)
+	{
+		if (UrgentLast)
+			node.cycle=0;	// Urgent pages always go in full
+		if (node.cycle)
+			*control|=CTRL_DELTA_bm;
+		node.cycle=(node.cycle+1)%DeltaCycle;
+		SetNode(&node,np);
 	}
-	// Now we know the page index, lets fetch the index record
-	f_lseek(&listFIL,(node.pageindex)*sizeof(PAGEINDEXRECORD));
-	f_read(&listFIL,&ixRec,sizeof(PAGEINDEXRECORD),&charcount);
-	// TODO: Check that charcount is plausible
-	*pageptr=ixRec.seekptr;
-	*pagesize=ixRec.pagesize;
 	//xprintf(PSTR("[GetPage] exits ptr=%l size=%l\n\r"),*pageptr, *pagesize);
 	return 0;
 } // GetPage
 
+uint8_t PageInUse(NODEPTR np)
+{
+	return np==PageNode;
+} // PageInUse
+
 /** InitStream - sets up default priorities
  *  Call this before starting the video chain
  */
@@ -77,9 +77,43 @@ typedef uint8_t MAGMASK;
 NODEPTR GetNextPage(MAGMASK mask);
 
 /**\brief Returns a page, consisting of a seek pointer to page.all and the page size
+ * \param control : Returns extra control bits for this transmission (CTRL_C8_UPDATE_bm)
+ * \param np : Returns the display node of the page. The node holds the cached PAGEMETA.
  * \return 0 if OK, >0 if problem
 */
-uint8_t GetPage(uint32_t *pageptr,uint32_t *pagesize, MAGMASK mask);
+uint8_t GetPage(uint32_t *pageptr,uint32_t *pagesize, MAGMASK mask, uint16_t *control, NODEPTR *np);
+
+/**\brief Insert holds on to the node from GetPage until it asks for the next page.
+ * Don't free it until then.
+ * \return 1 if np is the node that GetPage last returned
+ */
+uint8_t PageInUse(NODEPTR np);
+
+/**\brief Send a page as soon as its magazine has a free slot, with C8 set.
+ * It then gets a few quick repeats before going back to normal.
+ * \param mag : 1..8
+ * \param page : 0x00..0xff
+ * \return 0 if OK, 1 if the queue is full
+ */
+uint8_t UrgentPage(uint8_t mag, uint8_t page);
+
+/**\brief Row-delta repeats. A page goes out in full every n cycles
+ * and in between only its header (and changed rows of dynamic pages) is sent.
+ * \param n : Cycles per full transmission. 0 or 1 turns it off.
+ */
+void SetDeltaCycle(uint8_t n);
+
+/**\brief Fastext prefetch. The pages that a page links to go out ahead of the normal walk.
+ * \param n : Normal pages between boosted pages in a magazine. 0 turns it off.
+ */
+void SetFastextBoost(uint8_t n);
+
+/**\brief Ask for a page to be sent soon because a page that links to it has just gone out.
+ * Does nothing unless SetFastextBoost has turned it on.
+ * \param mag : 1..8 (0 is also mag 8)
+ * \param page : 0x00..0xfe
+ */
+void BoostPage(uint8_t mag, uint8_t page);
 
 /** \brief Initialise the streams
  */
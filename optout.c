@@ -0,0 +1,258 @@
+/*****************************************************************************
+ * Description       : Opt-out packets for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file optout.c
+ * Field accurate opt-out triggers
+ */
+
+#include "optout.h"
+
+#define NOLINE		0xff
+
+typedef struct
+{
+	uint32_t field;		// The air field of the next go
+	uint8_t type;		// OPTOUT_PREROLL, OPTOUT_START or OPTOUT_STOP
+	uint8_t left;		// Goes left. 0 is a free slot
+} OPTOUTTRIGGER;
+
+static char address[OPTOUTADDRESSLENGTH]={0,0,0,2,4,2};	// Nibbles. 000242 is Eurosport 2
+// The frames are fully encoded apart from the bit reversal, which is done on the copy
+static char frame[OPTOUTTYPES][PACKETSIZE];
+static uint8_t frameValid[OPTOUTTYPES];
+static uint8_t repeats=3;
+static uint8_t cadence=5;
+static OPTOUTTRIGGER trigger[OPTOUTQUEUESIZE];
+static uint32_t lastField=0xffffffff;	// The field that the last frame went out on
+
+// Lines that a frame may be written over in a block that is already loaded. Best first.
+static const char PROGMEM patchPreference[]="ZF12345678I";
+
+static uint8_t HexNibble(char ch)
+{
+	if (ch>='0' && ch<='9')
+		return ch-'0';
+	ch=toupper(ch);
+	if (ch>='A' && ch<='F')
+		return ch-'A'+10;
+	return 0xff;
+} // HexNibble
+
+/** Fill in everything around the user data and work out the CRC
+ */
+static void EncodeFrame(uint8_t type)
+{
+	char *p=frame[type];
+	uint8_t i;
+	WritePrefix(p,8,31);	// CRI,FC,MRAG
+	p[5]=HamTab[0];			// FT format A with implicit continuity and no repeats
+	p[6]=HamTab[OPTOUTADDRESSLENGTH];	// IAL
+	for (i=0;i<OPTOUTADDRESSLENGTH;i++)
+		p[7+i]=HamTab[(uint8_t)address[i]];
+	// There is no RI, CI or DL because FT=0, so the user data and the CRC start straight after the address.
+	// The user data already has its parity and the CRC bytes don't get any.
+	ClearCRC();
+	for (i=7+OPTOUTADDRESSLENGTH;i<43;i++)
+		AddCRC(p[i]);
+	EndPacket(&p[43],&p[44]);
+} // EncodeFrame
+
+uint8_t OptOutSetAddress(char *hex)
+{
+	char nibbles[OPTOUTADDRESSLENGTH];
+	uint8_t i;
+	for (i=0;i<OPTOUTADDRESSLENGTH;i++)
+	{
+		nibbles[i]=HexNibble(hex[i]);
+		if (nibbles[i]==0xff)
+			return 1;
+	}
+	memcpy(address,nibbles,OPTOUTADDRESSLENGTH);
+	for (i=0;i<OPTOUTTYPES;i++)
+		if (frameValid[i])
+			EncodeFrame(i);
+	return 0;
+} // OptOutSetAddress
+
+uint8_t OptOutSetFrame(uint8_t type, char *hex)
+{
+	char data[OPTOUTDATALENGTH];
+	uint8_t hi,lo;
+	uint8_t i;
+	if (type>=OPTOUTTYPES)
+		return 1;
+	for (i=0;i<OPTOUTDATALENGTH && hex[0] && hex[0]!='\n' && hex[0]!='\r';i++)
+	{
+		hi=HexNibble(hex[0]);
+		lo=HexNibble(hex[1]);
+		if (hi==0xff || lo==0xff)
+			return 1;
+		data[i]=(hi<<4)|lo;
+		hex+=2;
+	}
+	if (!i)
+	{
+		frameValid[type]=0;	// Nothing to send
+		return 0;
+	}
+	for (;i<OPTOUTDATALENGTH;i++)
+		data[i]=0x80;	// Padding. 0 with odd parity
+	memcpy(&frame[type][7+OPTOUTADDRESSLENGTH],data,OPTOUTDATALENGTH);
+	EncodeFrame(type);
+	frameValid[type]=1;
+	return 0;
+} // OptOutSetFrame
+
+uint8_t OptOutSetRepeat(uint8_t n, uint8_t fields)
+{
+	if (n<1 || n>10 || fields<1 || fields>250)
+		return 1;
+	repeats=n;
+	cadence=fields;
+	return 0;
+} // OptOutSetRepeat
+
+uint8_t OptOutTrigger(uint8_t type, uint16_t delay)
+{
+	uint8_t i;
+	uint32_t now;
+	if (type>=OPTOUTTYPES || !frameValid[type])
+		return 1;
+	for (i=0;i<OPTOUTQUEUESIZE;i++)
+		if (!trigger[i].left)
+			break;
+	if (i>=OPTOUTQUEUESIZE)
+		return 2;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		now=FieldCount;
+	}
+	trigger[i].field=now+delay;
+	trigger[i].type=type;
+	trigger[i].left=repeats;
+	return 0;
+} // OptOutTrigger
+
+/** Copy a trigger's frame into packet and take a go off it
+ */
+static void SendFrame(OPTOUTTRIGGER *t, char *packet)
+{
+	memcpy(packet,frame[t->type],PACKETSIZE);
+	Parity(packet,PACKETSIZE);	// Just the bit reverse
+	lastField=t->field;
+	if (--t->left)
+		t->field+=cadence;
+} // SendFrame
+
+/** Pick the line of a loaded block to write a frame over.
+ * A Z line or a filler is best. Failing that it has to be a page line,
+ * and that page will be short of a row until it comes round again.
+ * \param parity : Block number%2
+ * \return Line number, or NOLINE if the line plan has nowhere to put it
+ */
+static uint8_t PatchLine(uint8_t parity)
+{
+	uint8_t i;
+	uint8_t line;
+	char action;
+	for (i=0;(action=pgm_read_byte(&patchPreference[i]));i++)
+		for (line=0;line<VBILINES+parity;line++)
+			if (g_OutputActions[parity][line]==action)
+				return line;
+	return NOLINE;
+} // PatchLine
+
+void OptOutService(void)
+{
+	char packet[PACKETSIZE];
+	OPTOUTTRIGGER *t;
+	uint32_t now;
+	uint8_t read;
+	uint8_t loaded;
+	uint8_t block;
+	uint8_t line;
+	uint8_t i;
+	int32_t ahead;
+	for (i=0;i<OPTOUTQUEUESIZE;i++)
+	{
+		t=&trigger[i];
+		if (!t->left)
+			continue;
+		if (t->field==lastField)
+			t->field++;	// One frame per field. Writing over the last one would lose it.
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			if (FIFOBusy)
+				return;	// Try again after the field. The read index only moves while the FIFO is busy.
+			now=FieldCount;
+			read=fifoReadIndex;
+		}
+		// Blocks read..write-1 are loaded. Block k goes out on field now+(k-read) unless the lane gets in first.
+		// The indexes are only equal when the ring is full.
+		loaded=(fifoWriteIndex+MAXFIFOINDEX-read)%MAXFIFOINDEX;
+		if (!loaded)
+			loaded=MAXFIFOINDEX;
+		ahead=(int32_t)(t->field-now);
+		if (ahead<0)
+		{
+			t->field=now;	// Missed it. Get it out as soon as possible.
+			ahead=0;
+		}
+		if (ahead>=loaded)
+			continue;	// Not loaded yet. OptOutLine will put it in.
+		block=(read+ahead)%MAXFIFOINDEX;
+		line=PatchLine(block%2);
+		if (line==NOLINE)
+		{
+			t->left=0;
+			xprintf(PSTR("[OptOutService] No line to send it on\n"));
+			continue;
+		}
+		SendFrame(t,packet);
+		PORTC.OUT&=~VBIT_SEL; // Set the mux to MPU so that we are in control
+		SetSerialRamAddress(SPIRAM_WRITE, block*FIFOBLOCKSIZE+line*PACKETSIZE);
+		WriteSerialRam(packet,PACKETSIZE);
+	}
+} // OptOutService
+
+uint8_t OptOutLine(char *packet, uint32_t airfield)
+{
+	uint8_t i;
+	for (i=0;i<OPTOUTQUEUESIZE;i++)
+		if (trigger[i].left && (int32_t)(trigger[i].field-airfield)<=0)
+		{
+			trigger[i].field=airfield;	// In case it was late
+			SendFrame(&trigger[i],packet);
+			return 1;
+		}
+	return 0;
+} // OptOutLine
@@ -0,0 +1,106 @@
+/*****************************************************************************
+ * Description       : Opt-out packets for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Opt-out (cue) packets for regional switching.
+ * Each trigger type (preroll, start, stop) has a frame that is encoded in full when it is
+ * configured: 8/31 IDL format A with the configured address, user data and CRC.
+ * Sending one is then just a copy.
+ *
+ * A trigger is aimed at an air field (see AirField in vbi.c). If the FIFO block for that
+ * field has already been loaded, the frame is written straight over a line in that block.
+ * If not, the scheduler puts it in the block when it is loaded. Either way it goes out on
+ * the field that was asked for, however deep the FIFO lookahead is.
+ * A trigger can be repeated a number of times, a number of fields apart.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \brief Field accurate opt-out triggers
+*/
+#ifndef _OPTOUT_H_
+#define _OPTOUT_H_
+
+// These come before vbit.h because config.h needs them
+// Softel opt-outs have 6 address nibbles (24 bit)
+#define OPTOUTADDRESSLENGTH	6
+// User data goes from byte 13 up to the CRC
+#define OPTOUTDATALENGTH	30
+#define OPTOUTTYPES	3	// OPTOUT_PREROLL, OPTOUT_START, OPTOUT_STOP
+
+#include "avr_compiler.h"
+#include <avr/pgmspace.h>
+#include "xitoa.h"
+#include "vbit.h"
+
+// How many triggers can be waiting at once
+#define OPTOUTQUEUESIZE		4
+// The start frame that the W14 test used to send
+#define OPTOUTSTARTDEFAULT	"155001B0B0B03134B6B0B932B020204332B334B5B920202020D3CDD351E3"
+
+/** Set the address that goes in all the frames
+ * \param hex : 6 hex digits
+ * \return 0 if OK, 1 if the address is bad
+ */
+uint8_t OptOutSetAddress(char *hex);
+
+/** Set the user data of a frame and encode it
+ * \param type : OPTOUT_PREROLL, OPTOUT_START or OPTOUT_STOP
+ * \param hex : Up to 30 bytes in hex, as they are transmitted (with parity). Padded with 0x80.
+ * An empty string turns the frame off.
+ * \return 0 if OK, 1 if the data is bad
+ */
+uint8_t OptOutSetFrame(uint8_t type, char *hex);
+
+/** Set how triggers are repeated
+ * \param repeats : Number of times that each frame is sent 1..10
+ * \param cadence : Fields between repeats 1..250
+ * \return 0 if OK, 1 if out of range
+ */
+uint8_t OptOutSetRepeat(uint8_t repeats, uint8_t cadence);
+
+/** Trigger an opt-out
+ * \param type : OPTOUT_PREROLL, OPTOUT_START or OPTOUT_STOP
+ * \param delay : Fields from now. 0 is the first field that hasn't started to go out.
+ * \return 0 if OK, 1 if the frame isn't set up, 2 if too many triggers are waiting
+ */
+uint8_t OptOutTrigger(uint8_t type, uint16_t delay);
+
+/** Write any triggers that are due in blocks that are already loaded.
+ * Call from FillFIFO while the FIFO is ours.
+ */
+void OptOutService(void);
+
+/** Offer a line in the block that is being loaded
+ * \param packet : Packet to fill in, ready to go
+ * \param airfield : The field that the block will go out on
+ * \return 1 if the packet was used, 0 if there was nothing due
+ */
+uint8_t OptOutLine(char *packet, uint32_t airfield);
+
+#endif
@@ -23,6 +23,7 @@
  * this software.
  *************************************************************************** **/
 #include "p830f1.h"
+#include "packet.h"
 
 /* Globals */
 unsigned char pkt830[46];		/* The packet.40 chars + 2 CRI + WST+terminator */
@@ -59,7 +60,7 @@ void SetStatusLabel(unsigned char *pkt, char *str)
 	{
 		// if we haven't run out of string
 		if(*str != 0)
-			pkt[i] = ParTab[(int)*str++];
+			pkt[i] = pgm_read_byte(ParTab+(*str++ & 0x7f));	// ParTab is in progmem
 		else
 			pkt[i] = ' ';
 	}
@@ -110,15 +111,15 @@ int MakeOffset(int off)
  */
 void Init830F1(void)
 {
-	int i,n;
-
-	char str[MAXSTR];
+	int i;
 	unsigned char *p;
 	p=pkt830;
 	// Assemble the basic packet 8/30 format 1
-	*p++=0;                               // line number (?)
-	*p++=27;                              // framing code
-	*p++=HamTab[0];           // mrag  
+	// The array index is one less than the byte numbers in the comments
+	*p++=0x55;                            // 1,2   clock run in
+	*p++=0x55;
+	*p++=0x27;                            // 3     framing code
+	*p++=HamTab[0];           // mrag  (Packet830F1 writes 8/30 here)
 	*p++=HamTab[0xf];
 	*p++=HamTab[0];         // 6     designation code  
 	*p++=0x15;   			// 7-12  initial page
@@ -140,15 +141,10 @@ void Init830F1(void)
 		*p++=' ';
 
 	// update the packet with the settings we have
-	// (Get the following settings from the INI file)
-	n = ini_gets("p830f1", "initialpage", "003F7F", str, MAXSTR, inifile); // ppssss
-	// SetInitialPage(pkt830,str); NEED TO FIX!!!!
-	n=ini_gets("p830f1", "label", PSTR("VBITFax             "), str, MAXSTR, inifile);		
-	xputs(str);
-	SetStatusLabel(pkt830,PSTR("Your status label   "));
-	n = ini_gets("p830f1", "nic", "2a2f", str, MAXSTR, inifile); // need the drive already mounted
-	xputs(str);
-	SetNIC1(pkt830,str);
+	// (From the INI file, via g_Config. LoadINISettings has already read it)
+	// SetInitialPage(pkt830,g_Config.initialPage); NEED TO FIX!!!!
+	SetStatusLabel(pkt830,g_Config.label);
+	SetNIC1(pkt830,g_Config.nic);
 	// Local time offset
 	pkt830[14]=MakeOffset(0); // 0=GMT, 2=BST
 
@@ -166,5 +162,31 @@ void Init830F1(void)
 	pkt830[24] = HamTab[i];
 */
 
-} // Init830F1 
+} // Init830F1
+
+/** MJD and UTC digits are sent as 4 bit numbers, each one more than the digit
+ */
+static unsigned char Digits(uint8_t n)
+{
+	return (((n/10)+1)<<4) | ((n%10)+1);
+} // Digits
+
+void Packet830F1(char *packet, uint32_t utc, uint16_t mjd)
+{
+	uint8_t i;
+	for (i=5;i<PACKETSIZE;i++)
+		packet[i]=pkt830[i];
+	WritePrefix(packet,8,30);
+	// 16-18 MJD. Five digits so the first nibble is spare
+	packet[15]=(pkt830[15] & 0xf0) | ((mjd/10000)%10+1);
+	packet[16]=Digits((mjd/100)%100);
+	packet[17]=Digits(mjd%100);
+	// 19-21 UTC hh mm ss
+	packet[20]=Digits(utc%60);
+	utc/=60;
+	packet[19]=Digits(utc%60);
+	packet[18]=Digits(utc/60);
+	// Hamming, parity and the label parity are already done. Just reverse the bits.
+	Parity(packet,PACKETSIZE);
+} // Packet830F1 
 
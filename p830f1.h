@@ -36,12 +36,19 @@ The time must be recalculated every time that this is called.
 
 extern const char inifile[];
 #define MAXSTR 80
+#include <stdint.h>
 #include "tables.h"
 #include "xitoa.h"
 #include "../minini/minIni.h"
 extern unsigned char pkt830[46];		/* The packet.40 chars + 2 CRI + WST+MRAG+terminator */
 	
 void Init830F1(void);
+/** Make the 8/30 format 1 packet ready to go out
+ * \param packet : 45 byte packet buffer
+ * \param utc : Time of day in seconds when it goes out
+ * \param mjd : Date when it goes out
+ */
+void Packet830F1(char *packet, uint32_t utc, uint16_t mjd);
 void SetNIC1(unsigned char *pkt,char *nic);
 void SetStatusLabel(unsigned char *pkt, char *str);
 /*
@@ -47,8 +47,12 @@
  */
 
 #include "packet.h"
+#include "pagestore.h"
 
 static uint8_t fifoLineCounter=0; // vbi line 0..15
+static uint32_t blockAirField;	// The field that the FIFO block being loaded will go out on
+static OPENPAGE openPage;	// The page that insert last sent a header for
+static OPENPAGE blockOpenPage[MAXFIFOINDEX];	// openPage as it was at the start of each block
 
 // The state of the 8 magazines
 static unsigned char state[8]={0,0,0,0,0,0,0,0};
@@ -58,20 +62,24 @@ static unsigned char state[8]={0,0,0,0,0,0,0,0};
 #define STATE_HEADER	2
 #define STATE_SENDING	3
 
-// How many vbi lines per field. Not quite right. Odd field is 17 (6..22), Even is 18 (318..335).
-#define VBILINES	17
-
 char g_OutputActions[2][18];
 char g_Header[32]; // Add one for luck (or terminator)
 
 int OptRelays;			/** Holds the current state of the opt out relay signals */
 
-unsigned char OptOutMode=0;	// Which ATP950 mode. If 0, then do nothing
-unsigned char OptOutType=OPTOUT_START;	// One of the OPTOUT values
-
 // These are global file objects
 FIL pagefileFIL, listFIL;
 
+/** Reverse the bits of a byte into transmission order
+ */
+static uint8_t ReverseBits(uint8_t c)
+{
+	c = (c & 0x0F) << 4 | (c & 0xF0) >> 4;
+	c = (c & 0x33) << 2 | (c & 0xCC) >> 2;
+	c = (c & 0x55) << 1 | (c & 0xAA) >> 1;	
+	return c;
+} // ReverseBits
+
 /** Check that parity is correct for the packet payload
  * The parity is set to odd for all bytes from offset to the end
  * Offset should be at least 3, as the first three bytes have even parity
@@ -82,20 +90,13 @@ FIL pagefileFIL, listFIL;
 void Parity(char *packet, uint8_t offset)
 {
 	int i;
-	uint8_t c;
 	for (i=offset;i<PACKETSIZE;i++)
 	{
 		
 		packet[i]=pgm_read_byte(ParTab+(uint8_t)(packet[i]&0x7f)); // Strange syntax because of ParTab in progmem
 	}
 	for (i=0;i<PACKETSIZE;i++)
-	{
-		c=(uint8_t)packet[i];
-		c = (c & 0x0F) << 4 | (c & 0xF0) >> 4;
-		c = (c & 0x33) << 2 | (c & 0xCC) >> 2;
-		c = (c & 0x55) << 1 | (c & 0xAA) >> 1;	
-		packet[i]=(char)c;
-	}
+		packet[i]=(char)ReverseBits((uint8_t)packet[i]);
 } // Parity
 
 /** The prefix is the first five characters
@@ -162,15 +163,89 @@ void QuietLine(char * packet, uint8_t code)
 		}
 } // QuietLine
 
+/* Header template
+ * The caption part of the header (bytes 13 to 44) is the same for every page
+ * so we only encode it when the caption (normally g_Header) changes. The offsets of the page number
+ * and the clock digits are recorded so that Header() only has to patch those bytes.
+ * The template holds bytes that have already had parity added and been bit reversed.
+ */
+static char headerTemplate[PACKETSIZE];
+static uint8_t headerValid=0;	// Cleared by InvalidateHeader
+static char *headerCaption;		// The caption that the template was made from
+static uint8_t headerMpp;		// Offset of "mpp" in the header or 0 if there isn't one
+static uint8_t headerClock[6];	// Offsets of the hh mm ss digits
+static uint8_t headerClockDigits;	// How many of the clock digits are in use
+static char encodedHex[16];		// 0..F with parity, bit reversed
+static char encodedClock[6];	// The current time digits, with parity, bit reversed
+static uint32_t encodedSecond=0xffffffff;	// The UTC that encodedClock holds
+
+/** Parity and bit reverse a single character, the same as Parity() does
+ */
+static char EncodeChar(char ch)
+{
+	return (char)ReverseBits(pgm_read_byte(ParTab+(uint8_t)(ch&0x7f)));
+} // EncodeChar
+
+/** Call this whenever g_Header is changed
+ */
+void InvalidateHeader(void)
+{
+	headerValid=0;
+} // InvalidateHeader
+
+/** Encode a caption into the header template
+ * \param caption : Up to 32 characters
+ */
+static void BuildHeaderTemplate(char *caption)
+{
+	char *p=headerTemplate;
+	char ch;
+	uint8_t i;
+	uint8_t mppEnd=0;
+	headerCaption=caption;
+	strncpy(&p[13],caption,32); // Same as strncpy in the old Header. Short captions are padded with nulls
+	// Find "mpp". The page number gets put here.
+	headerMpp=0;
+	for (i=13;i<PACKETSIZE-2 && p[i];i++)
+		if (p[i]=='m' && p[i+1]=='p' && p[i+2]=='p')
+		{
+			headerMpp=i;
+			mppEnd=i+3;
+			break;
+		}
+	// Find the clock digits in the last 8 characters of the heading
+	headerClockDigits=0;
+	for (i=37;i<=44;i++)
+	{
+		if (headerMpp && i>=headerMpp && i<mppEnd)
+			continue;
+		if (p[i]=='\r')	// Replace spurious double height. This can really destroy a TV!
+			p[i]='?';
+		if ((p[i]>='0') && (p[i]<='9'))
+		{
+			if (headerClockDigits<6)
+				headerClock[headerClockDigits++]=i;
+			else
+				p[i]='?';
+		}
+	}
+	for (i=13;i<PACKETSIZE;i++)
+		p[i]=EncodeChar(p[i]);
+	for (i=0;i<16;i++)
+	{
+		ch=i+(i>9?'7':'0');	// note wacky way of converting digit to hex
+		encodedHex[i]=EncodeChar(ch);
+	}
+	encodedSecond=0xffffffff;	// Force the clock to be encoded again
+	headerValid=1;
+} // BuildHeaderTemplate
+
 /** A header has mag, row=0, page, flags, caption and time
  */
 void Header(char *packet ,unsigned char mag, unsigned char page, unsigned int subcode,
 			unsigned int control, char *caption)
 {
-	char *p;
-	char ch;
-	int i,j;
-	static int lastsec;
+	int i;
 	// BEGIN: Special effect. Go to page 100 and press Button 1.
 	// Every page becomes P100.
 	if (BUTTON_GetStatus(BUTTON_1))
@@ -181,6 +256,8 @@ void Header(char *packet ,unsigned char mag, unsigned char page, unsigned int su
 	uint8_t hour, min, sec;
 	uint32_t utc;
 	uint8_t cbit;
+	if (!headerValid || caption!=headerCaption)
+		BuildHeaderTemplate(caption);	// The cache holds the last caption used
 	WritePrefix(packet,mag,0);
 	packet[5]=HamTab[page%0x10];
 	packet[6]=HamTab[page/0x10];
@@ -211,52 +288,37 @@ void Header(char *packet ,unsigned char mag, unsigned char page, unsigned int su
 	cbit=(control & 0x0380) >> 6;	// Shift the language bits C12,C13,C14. TODO: Check if C12/C14 need swapping. CHECKED OK.
 	if (control & 0x0040) cbit|=0x01;	// C11 serial/parallel
 	packet[12]=HamTab[cbit]; // C11 to C14 (C11=0 is parallel, C2,C13,C14 language)
-	strncpy(&packet[13],caption,32); // This is dangerously out of order! Need to range check and fill as needed
+	for (i=0;i<13;i++)
+		packet[i]=(char)ReverseBits((uint8_t)packet[i]);
+	// The caption is already encoded
+	memcpy(&packet[13],&headerTemplate[13],PACKETSIZE-13);
 	// Stuff the page number in. TODO: make it work with hex numbers etc.
-	p=strstr(packet,"mpp"); 
-	if (p) // if we have mpp, replace it with the actual page number...
+	if (headerMpp) // if we have mpp, replace it with the actual page number...
 	{
-		*p++=mag+'0';
-		ch=page>>4; // page tens (note wacky way of converting digit to hex)
-		*p++=ch+(ch>9?'7':'0');
-		ch=page%0x10; // page units
-		*p++=ch+(ch>9?'7':'0');
+		packet[headerMpp]=encodedHex[mag&0x0f];
+		packet[headerMpp+1]=encodedHex[page>>4];	// page tens
+		packet[headerMpp+2]=encodedHex[page%0x10];	// page units
 	}
-	// xputc(packet[20]); // Echo the mag for debugging
 	// Stick the time in. Need to implement flexible date/time formatting
-	utc=UTC;
-	sec=utc%60;
-	utc/=60;
-	min=utc%60;
-	hour=utc/60;
-	//if (lastsec!=sec)
-	//	xprintf(PSTR("%02d:%02d.%02d "),hour,min,sec);
-	lastsec=sec;
-	//sprintf(&packet[37],"%02d:%02d.%02d",hour,min,sec);
-	
-	// Format the time string in the last 8 characters of the heading
-	j=0;
-	for (i=37;i<=44;i++)
+	// Use the time that this packet will actually go out, not the time now.
+	// The digits only change once a second so only encode them then
+	utc=FieldToUTC(blockAirField);
+	if (utc!=encodedSecond)
 	{
-		if (packet[i]=='\r')	// Replace spurious double height. This can really destroy a TV!
-			packet[i]='?';
-		if ((packet[i]>='0') && (packet[i]<='9'))
-		{
-			packet[i]='0';
-			switch (j++)
-			{
-			case 0:packet[i]+=hour/10;break;
-			case 1:packet[i]+=hour%10;break;
-			case 2:packet[i]+= min/10;break;
-			case 3:packet[i]+= min%10;break;
-			case 4:packet[i]+= sec/10;break;
-			case 5:packet[i]+= sec%10;break;
-			default:
-				packet[i]='?';
-			}
-		}
+		encodedSecond=utc;
+		sec=utc%60;
+		utc/=60;
+		min=utc%60;
+		hour=utc/60;
+		encodedClock[0]=encodedHex[hour/10];
+		encodedClock[1]=encodedHex[hour%10];
+		encodedClock[2]=encodedHex[min/10];
+		encodedClock[3]=encodedHex[min%10];
+		encodedClock[4]=encodedHex[sec/10];
+		encodedClock[5]=encodedHex[sec%10];
 	}
-	Parity(packet,13);		
+	for (i=0;i<headerClockDigits;i++)
+		packet[headerClock[i]]=encodedClock[i];
 } // Header
 
 void Row(char * packet, unsigned char mag, unsigned char row, char * str)
@@ -272,29 +334,33 @@ void Row(char * packet, unsigned char mag, unsigned char row, char * str)
  * <line> has two methods of escaping, which need to be decoded
  * \return The row number
  */
-static unsigned char copyOL(char *packet, char *textline)
+unsigned char copyOL(char *packet, char *textline, uint8_t length)
 {
 	int i;
 	long linenumber;
+	char *lineend=textline+length; // The line might not be null terminated (see pagestore.h)
 	// Get the line number
 	textline+=3;
 	char ch;
-	xatoi(&textline, &linenumber);
+	linenumber=0;
+	// xatoi needs a terminator, so do the digits ourselves
+	for (i=0;i<2 && textline<lineend && isdigit(*textline);i++)
+		linenumber=linenumber*10+(*textline++-'0');
 	//xprintf(PSTR("Line number=%d\n"),(int)linenumber);
 	// Skip to the comma to get the body of the command
-	for (i=0;i<4 && ((*textline++)!=',');i++);
+	for (i=0;i<4 && textline<lineend && ((*textline++)!=',');i++);
 	if (*(textline-1)!=',')
 	{
 		xputc('F');
 		return 0xff; // failed
 	}
-	for (char *p=packet+5;p<(packet+PACKETSIZE);p++)*p='P'; // If you see a line full of P, we dun goofed.
-	for (char *p=packet+5;*textline && p<(packet+PACKETSIZE);textline++) // Stop on end of file OR packet over run
+	for (char *p=packet+5;p<(packet+PACKETSIZE);p++)*p=' '; // Anything that isn't copied is blank
+	for (char *p=packet+5;textline<lineend && *textline && p<(packet+PACKETSIZE);textline++) // Stop on end of file OR packet over run
 	{
 		// TODO: Also need to check viewdata escapes
 		// Only handle MRG mapping atm
 		ch=*textline; // Don't strip off the top bit just yet!
-		if ((ch!=0x0d) && (ch & 0x7f)) // Do not include \r or null
+		if ((ch!=0x0d) && (ch!=0x0a) && (ch & 0x7f)) // Do not include \r, the \n that ends the line or null
 		{
 			if ((ch & 0x7f)==0x0a)		
 			{
@@ -306,13 +372,8 @@ static unsigned char copyOL(char *packet, char *textline)
 		}
 		else
 		{
-			// \r is not valid in an MRG page, so it must be a truncated line
-			// Fill the rest of the line in with blanks
-			char *r;
-			for (r=p;r<(packet+PACKETSIZE);r++)
-				*r=' '; // fill to end with blanks
-				// *r='z'-(char)(PACKETSIZE-(char)((int)packet+(int)r)); // was space but I want it visible
-			// *r='E';    // Make the last one visibly different (debugging)
+			// \r is not valid in an MRG page, so it must be a truncated line (or the end of it)
+			// The rest of the line was already filled with blanks
 			break;
 		}
 		// if ((*p & 0x7f)==0) *p=' '; // In case a null sneaked in
@@ -322,10 +383,25 @@ static unsigned char copyOL(char *packet, char *textline)
 	return linenumber;
 } // copyOL
 
+/** A row of nothing but spaces. If the page has C4 set then the decoder clears
+ * the rows that we don't send, so a blank row is a wasted line.
+ * \param packet : Packet before parity is added
+ * \return 1 if the row is blank
+ */
+static uint8_t BlankRow(char *packet)
+{
+	uint8_t i;
+	for (i=5;i<PACKETSIZE;i++)
+		if (packet[i]!=' ')
+			return 0;
+	return 1;
+} // BlankRow
+
 /** Fastext links
  * FL,<link red>,<link green>,<link yellow,<link cyan>,<link>,<link index>
+ * \param links : Returns the four colour links (mpp). Any that are missing are left alone.
  */
-static void copyFL(char *packet, char *textline, PAGE *page)
+static void copyFL(char *packet, char *textline, PAGE *page, uint16_t *links)
 {
 	long nLink;
 	// add the designation code
@@ -344,12 +420,12 @@ static void copyFL(char *packet, char *textline, PAGE *page)
 	packet[44]=HamTab[0];
 
 	// for each of the six links
-	for (int i=0; (i < 6); i++)
+	for (int link=0; link<6; link++)
 	{
 		// TODO: Simplify this. It can't be that difficult to read 6 hex numbers.
 		// TODO: It needs to be much more flexible in the formats that it will accept
 		// Skip to the comma to get the body of the command
-		for (i=0;i<6 && ((*textline++)!=',');i++);
+		for (int i=0;i<6 && ((*textline++)!=',');i++);
 		if (*(textline-1)!=',')
 		{
 			return; // failed :-(
@@ -359,6 +435,8 @@ static void copyFL(char *packet, char *textline, PAGE *page)
 		*ptr='0';
 		*(ptr+1)='x';
 		xatoi(&ptr,&nLink);
+		if (link<4)
+			links[link]=nLink;
 		//if (page->page==0 && page->mag==1)
 		//{
 //			xprintf(PSTR("[copyFL]page 100 link:%X\n"),nLink);
@@ -397,16 +475,22 @@ static unsigned char insert(char *packet, uint8_t field)
 	//char listentry[25];
 	char data[80];
 	char *str;
-	static char *redirectPtr;	// When a page is redirected to SRAM we use this pointer
-	static char *redirectEnd;	// When a page is redirected to SRAM we use this pointer
-	static uint8_t redirectrow;	// When redirecting, use this as a row counter. Need to improve this to NOT transmit blank lines.
+	uint8_t len;				// Length of the line in str
+	static uint8_t redirectrow;	// When redirecting, the next row to send. Rows that were never written are skipped.
 	// char *p;
 	unsigned char row;
 	static uint8_t myfield;
 	FRESULT res=0;	
 	BYTE drive=0;
-	DWORD pageptr;				// Pointer to the start of page in pages.all
-	DWORD pagesize;				// Size of the page in pages.all
+	static DWORD pageptr;		// Pointer to the start of page in pages.all
+	static DWORD pagesize;		// Size of the page in pages.all
+	static uint16_t pagecontrol;	// Extra control bits from GetPage
+	static NODEPTR pagenode;	// Display node of the page, from GetPage
+	DISPLAYNODE node;
+	static uint8_t deltaOnly;	// Row-delta repeat. The SD page is just the header.
+	static char caption[24];	// Header bytes 13..36 as sent, for the page CRC in X/27/0
+	uint16_t crc;
+	uint16_t links[4];			// Fastext colour links, for the prefetch
 	unsigned char mag=0;	// just one mag for now!
 	// xputc(state[mag]+'0');
 	// DEBUG CODE
@@ -424,8 +508,11 @@ static unsigned char insert(char *packet, uint8_t field)
 		res=(WORD)disk_initialize(drive);	// di0
 		put_rc(f_mount(drive, &Fatfs[drive]));	// fi0 /*!!!*/
 		put_rc(f_chdir("onair"));
+		res=PageStoreOpen();	// Only need to open this once!
+		if (res)
+			return 1;
 		// res=f_open(&listFIL,"mag1.lst",FA_READ);	
-		res=GetPage(&pageptr,&pagesize,0xff);	// Get the next transmission page details. TODO: A proper mask. TODO: A return value
+		res=GetPage(&pageptr,&pagesize,0xff,&pagecontrol,&pagenode);	// Get the next transmission page details. TODO: A proper mask. TODO: A return value
 		if (res)
 		{
 			xprintf(PSTR("[insert]Epic Fail: Could not open initial page\r\n"));			
@@ -454,10 +541,7 @@ static unsigned char insert(char *packet, uint8_t field)
 		xprintf(PSTR("\n\rf=%s\n\r"),pagename);		
 		*/
 		state[mag]=STATE_IDLE;
-		res=f_open(&pagefileFIL,"pages.all",FA_READ);		// Only need to open this once!
 		// xputs(PSTR("STATE_BEGIN\n\n\r"));
-		if (res)
-			xprintf(PSTR("Failed to open pages.all, res=%d\n\n"),res); 
 	case STATE_IDLE: // If permitted to run we send the header
 		// xputs(PSTR("I"));
 		noCarousel=0; // Just until we can handle carousels
@@ -466,7 +550,24 @@ static unsigned char insert(char *packet, uint8_t field)
 		// Need to do the whole parse and parity bit here 
 		// open pagefile
 		//LED_On( LED_1 );		// LED5 - high while seeking a folder
-		res=f_lseek(&pagefileFIL,pageptr); // Instead of f_open just use lseek
+		ClearPage(&page); // Clear the page parameters (not strictly required)
+		// If the page has been out before, the node has the details and where the rows start
+		if (pagenode!=NULLPTR)
+			GetNode(&node,pagenode);
+		else
+			node.meta.body=0;
+		if (node.meta.body)
+		{
+			page.mag=node.meta.mag;
+			page.page=node.meta.page;
+			page.subpage=node.meta.subpage;
+			page.control=node.meta.control;
+			page.redirect=node.meta.redirect;
+			page.time=node.meta.time;
+			res=PageStoreSeek(pageptr+node.meta.body);	// Straight to the rows
+		}
+		else
+			res=PageStoreSeek(pageptr); // Instead of f_open just use lseek
 		//LED_Off( LED_1 ); // Need to define the correct LED
 		if (res)
 		{
@@ -474,17 +575,34 @@ static unsigned char insert(char *packet, uint8_t field)
 			put_rc(res);
 			return 1;
 		}	
-		ClearPage(&page); // Clear the page parameters (not strictly required)
 		// Loop through the header and parse down to the OL
-		while (pagefileFIL.fptr<(pageptr+pagesize))
+		while (!node.meta.body && PageStoreTell()<(pageptr+pagesize))
 		{
-			fileptr=pagefileFIL.fptr;		// Save the file pointer in case we found "OL"
-			f_gets(data,sizeof(data),&pagefileFIL);
-			if (data[0]=='O' && data[1]=='L')
+			fileptr=PageStoreTell();		// Save the file pointer in case we found "OL"
+			str=PageStoreGetLine(data,sizeof(data),&len);
+			if (!str)
+				break;
+			if (str[0]=='O' && str[1]=='L')
 			{
-				f_lseek (&pagefileFIL, fileptr);	// Step back to the OL line
+				PageStoreSeek(fileptr);	// Step back to the OL line
+				if (pagenode!=NULLPTR)	// Remember all that for next time
+				{
+					node.meta.mag=page.mag;
+					node.meta.page=page.page;
+					node.meta.subpage=page.subpage;
+					node.meta.control=page.control;
+					node.meta.redirect=page.redirect;
+					node.meta.body=fileptr-pageptr;
+					node.meta.time=page.time;
+					SetNode(&node,pagenode);
+				}
 				break;
 			}
+			if (str!=data)	// ParseLine writes on the line so it needs its own copy
+			{
+				memcpy(data,str,len);
+				data[len]=0;
+			}
 			if (ParseLine(&page, data))
 			{
 				xprintf(PSTR("[insert]file error handler needed:%s\n"),data);
@@ -492,18 +610,26 @@ static unsigned char insert(char *packet, uint8_t field)
 				break; // what else should we do if we get here?
 			}
 		}
+		page.control|=pagecontrol;	// C8 if the page is urgent
+		deltaOnly=(page.control & CTRL_DELTA_bm)?1:0;
+		if (deltaOnly)
+			page.control&=~CTRL_C4_ERASEBIT_bm;	// The rows that we don't send must stay on the screen
 		// xprintf(PSTR("MPP: %d%02X\n\r"),page.mag,page.page);
 		// create the header packet. TODO: Add a system wide header caption
 		// xputs(PSTR("H"));
 		Header(packet,page.mag,page.page,page.subpage,page.control,g_Header);		// 6 - 24 characters plus 8 for clock
+		memcpy(caption,&packet[13],sizeof(caption));
 		state[mag]=STATE_HEADER;
+		openPage.mag=page.mag;	// Remember it in case the lane butts in
+		openPage.page=page.page;
+		openPage.subcode=page.subpage;
+		openPage.control=page.control;
 		// TODO: check that page.redirect is indicating a redirect,
 		// if so then set up the pointer. (Also see JA/JW commands)
 		if (page.redirect<SRAMPAGECOUNT)
 		{
-			redirectPtr=(char *)SRAMPAGEBASE+page.redirect*SRAMPAGESIZE;
-			redirectEnd=(char *)redirectPtr+SRAMPAGESIZE;
-			redirectrow=1;
+			DynPageSwap(page.redirect,deltaOnly);	// Rows written since last time go out from now
+			redirectrow=DynPageNextRow(page.redirect,1);
 			// These are just for debugging
 			//packet[17]='p';
 			//packet[18]='a';packet[21]='A'+page.redirect; // A to N
@@ -512,9 +638,25 @@ static unsigned char insert(char *packet, uint8_t field)
 			//Parity(packet,13);	
 			
 		}
+		else
+			redirectrow=DYNPAGE_END;	// Not redirected, or RD is out of range
 		break;
 	case STATE_HEADER: // We are waiting for the field to change before we can tx
 		// xputs(PSTR("H"));
+		if (deltaOnly && redirectrow==DYNPAGE_END)
+		{
+			// A delta with no rows has nothing to wait for, so the next page can have the rest of this field
+			QuietLine(packet,0x0f);
+			res=GetPage(&pageptr,&pagesize,0xff,&pagecontrol,&pagenode);
+			if (res)
+			{
+				xprintf(PSTR("[insert]Epic Fail: Could not open initial page\r\n"));			
+				put_rc(res);
+				return 1;
+			}
+			state[mag]=STATE_IDLE;
+			break;
+		}
 		if (field==savefield)
 		{
 			// xputs(PSTR("W"));
@@ -530,35 +672,23 @@ static unsigned char insert(char *packet, uint8_t field)
 		// and insert it here
 		if (page.redirect!=0xff)
 		{
-			// Get the next valid line of SRAM data (it must start with 0x55
-			packet[0]=0;
-			DeselectSerialRam();
-			// xprintf(PSTR("Redirect reading from=%04X\n"),redirectPtr);
-			SetSerialRamAddress(SPIRAM_READ, (uint16_t)redirectPtr);
-			ReadSerialRam(data,PACKETSIZE);	// Could load direct into packet, but it may be a bug?
-			DeselectSerialRam();
-			for (int i=0;i<PACKETSIZE;i++)
-				packet[i]=data[i];
-			redirectPtr+=PACKETSIZE;					
-
-			// If there is no sensible data then draw dots
-			if (packet[0]!=0x55)
-			{
-				for (int i=5;i<45;i++)
-					packet[i]='.';
-				packet[3]=redirectrow;
-			}
-			redirectrow++;
-			
-			// [should]Validate for CRI/FC
-			if (redirectPtr>=redirectEnd) // The page is ended?
+			if (redirectrow==DYNPAGE_END) // The page is ended?
 			{
 				state[mag]=STATE_IDLE;	// Set the IDLE state and get ready for the next page
 				noCarousel=1;
-				res=GetPage(&pageptr,&pagesize,0xff);	// Get the next transmission page details. 	
+				res=GetPage(&pageptr,&pagesize,0xff,&pagecontrol,&pagenode);	// Get the next transmission page details. 	
 				QuietLine(packet,0x0f);	// Wipe out this line, just in case			
 				break;
 			}
+			// Get the next row of SRAM data
+			DeselectSerialRam();
+			SetSerialRamAddress(SPIRAM_READ, DynPageRowAddress(page.redirect,redirectrow));
+			ReadSerialRam(data,PACKETSIZE);	// Could load direct into packet, but it may be a bug?
+			DeselectSerialRam();
+			for (int i=0;i<PACKETSIZE;i++)
+				packet[i]=data[i];
+			redirectrow=DynPageNextRow(page.redirect,redirectrow+1);
+			// [should]Validate for CRI/FC
 			// Put the page's mag number in place of the one we have got.
 			// Note that the row is in packet[3]
 			WritePrefix(packet, page.mag, packet[3]); // This prefix gets replaced later
@@ -573,9 +703,11 @@ static unsigned char insert(char *packet, uint8_t field)
 		// If we have copied all the pages then we go to STATE_IDLE.		
 		// STATE_IDLE if The ptr has an invalid CRI/MRAG or ptr is at the end of the page
 		// else // normal page
-		if (f_eof(&pagefileFIL) || noCarousel || (pagefileFIL.fptr>=(pageptr+pagesize))) // Page done?
+		if (noCarousel || deltaOnly || (PageStoreTell()>=(pageptr+pagesize))) // Page done?
 		{
-			res=GetPage(&pageptr,&pagesize,0xff);	// Get the next transmission page details. TODO: A proper mask. TODO: A return value
+			if (deltaOnly)
+				QuietLine(packet,0x0f);	// Otherwise the last packet goes again
+			res=GetPage(&pageptr,&pagesize,0xff,&pagecontrol,&pagenode);	// Get the next transmission page details. TODO: A proper mask. TODO: A return value
 			if (res)
 			{
 				xprintf(PSTR("[insert]Epic Fail: Could not open initial page\r\n"));			
@@ -614,27 +746,59 @@ static unsigned char insert(char *packet, uint8_t field)
 		{
 			// Get the next line from SD card
 			// xputs(PSTR("S"));
-			str=f_gets(data,sizeof(data),&pagefileFIL);
-			if (str)
+			// Blank rows of an erase page are skipped, so it can take more than one line
+			while ((str=PageStoreGetLine(data,sizeof(data),&len)))
 			{
 				// Now we need to parse the line and send it to the packet
 				// xprintf(PSTR("p=%s\n\r"),data);	 // instead of dumping it!
 				if (str[0]=='O' && str[1]=='L')		// Normal text line
 				{
-					row=copyOL(packet,str);
+					row=copyOL(packet,str,len);
 					if (row==0xff)
 						xprintf(PSTR("[insert]Error: Page file has bad line:%s\n"),str);	
+					// Skip a blank display row unless it is the last thing on the page
+					if ((page.control & (CTRL_C4_ERASEBIT_bm|CTRL_KEEPBLANKROWS_bm))==CTRL_C4_ERASEBIT_bm &&
+						row>=1 && row<=24 && BlankRow(packet) && PageStoreTell()<(pageptr+pagesize))
+						continue;
 					WritePrefix(packet,page.mag,row);
 				}
+				if (str[0]=='F' && str[1]=='X')		// Fastext links, already encoded
+				{
+					noCarousel=1; // The FL line after this one is only for copyFL
+					for (crc=0,row=0;row<sizeof(caption);row++)
+						crc=PageCRCByte(crc,ReverseBits((uint8_t)caption[row]));
+					if (FastextPacket(packet,str,len,crc))
+					{
+						xprintf(PSTR("[insert]Error: Page file has bad line:%s\n"),str);
+						QuietLine(packet,0x0f);
+						break;
+					}
+					WritePrefix(packet,page.mag,27); // X/27/0
+					Parity(packet,PACKETSIZE);	// Already hammed and the CRC must not get parity. Just reverse it.
+					FastextLinks(str,page.mag,links);
+					for (row=0;row<4;row++)
+						BoostPage(links[row]>>8,links[row]);	// The viewer will probably want one of these next
+					break;
+				}
 				if (str[0]=='F' && str[1]=='L')		// Fastext links X26
 				{
 					noCarousel=1; // Indicate the end of this page. Kill it now. TODO: Implement carousels
-					copyFL(packet,str,&page);	
+					if (str!=data)	// copyFL writes on the line
+					{
+						memcpy(data,str,len);
+						data[len]=0;
+					}
+					for (row=0;row<4;row++)
+						links[row]=0x8ff;	// No page
+					copyFL(packet,data,&page,links);	
 					WritePrefix(packet,page.mag,27); // X/27/0	
+					for (row=0;row<4;row++)
+						BoostPage(links[row]>>8,links[row]);
 				}
 				Parity(packet,5);	
+				break;
 			}
-			else
+			if (!str)
 			{
 				xputs("[insert]Error: Page file has empty line in it\n");
 				state[mag]=STATE_BEGIN;
@@ -673,6 +837,29 @@ void dump(char* p)
 	}
 }
 
+void GetOpenPage(uint8_t block, OPENPAGE *open)
+{
+	if (block==fifoWriteIndex && !fifoLineCounter && fifoWriteIndex!=fifoReadIndex)
+	{
+		// Not started yet, so it will be whatever is open now.
+		// (If the ring is full this is the block on air, which has its own record)
+		*open=openPage;
+		if (state[0]!=STATE_HEADER && state[0]!=STATE_SENDING)
+			open->mag=0;
+	}
+	else
+		*open=blockOpenPage[block%MAXFIFOINDEX];
+} // GetOpenPage
+
+/** Called at the start of each FIFO block
+ */
+static void StartBlock(void)
+{
+	blockAirField=AirField();	// Tag the block with the field that it will be transmitted on
+	GetOpenPage(fifoWriteIndex,&blockOpenPage[fifoWriteIndex]);
+	ScheduleBlock(blockAirField);
+} // StartBlock
+
 /** Loads the FIFO with text packets
  *  until either the FIFO is full
  *  or the FIFO is busy when we want to write to it.
@@ -680,14 +867,7 @@ void dump(char* p)
  */
 void FillFIFO(void)
 {
-#define opt_out_test	
-#ifdef opt_out_test	
-	static char testOptMode;	// modes are 0..3
-	static char testOptRate=0;	// Rate reducer
-	static int OldOptRelays=0;	// Tell if the Opts changed
-#endif	
 	char action;
-	char *p;
 	static char packet[PACKETSIZE];
 	uint16_t fifoWriteAddress;
 	static uint8_t packetToWrite=0; // Flags a left over packet that we need to send
@@ -695,13 +875,26 @@ void FillFIFO(void)
 	// xputc(PORTC.IN&VBIT_FLD?'O':'E'); // Odd even indicator (just debug nonsense)
 	uint8_t evenfield; //=PORTC.IN&VBIT_FLD?1:0;	// Odd or even?
 	
+	FIFODepthControl();
+	SubtitleService();	// Subtitles go before anything else
+	DynPageFlush();		// Any JW rows waiting for the serial RAM
+	OptOutService();	// Opt-outs due in blocks that are already loaded
 	if (fifoWriteIndex==fifoReadIndex)
 	{
 		return;	// FIFO Full
 	}	
+	// Only let a new block start if we are not too far ahead
+	if (!fifoLineCounter && (fifoWriteIndex+MAXFIFOINDEX-fifoReadIndex)%MAXFIFOINDEX>=fifoDepth)
+	{
+		return;	// Far enough ahead for now
+	}
 
 	// Get the FIFO ready for new data
 	PORTC.OUT&=~VBIT_SEL; // Set the mux to MPU so that we are in control
+	if (!fifoLineCounter)
+		StartBlock();
+	else
+		blockAirField=AirField();
 
 	fifoWriteAddress=fifoWriteIndex*FIFOBLOCKSIZE+fifoLineCounter*PACKETSIZE; 
 	// Don't need to set the address until later. Why do it here?
@@ -739,78 +932,19 @@ void FillFIFO(void)
 			case '7' :;
 			case '8' :;
 				// xputs(PSTR("i"));			
+				if (ScheduleLine(packet))
+					break;	// Reserved for a periodic packet
 				if (insert(packet,evenfield))
 					return;	// Oops fail
 				break;
-			case 'Z' : // How can this even get here when there is no Z?
-				if (OptOutMode>0)
-				{
-					xprintf(PSTR("in ur code, doing ur optout\n"));
-					switch (OptOutMode)
-					{
-					case 14:
-						switch (OptOutType)
-						{
-						case OPTOUT_PREROLL:;
-						case OPTOUT_START:;
-						case OPTOUT_STOP:;
-							SendOpt14(packet);
-							dump(packet);
-							Parity(packet,14);		// Do the parity and bit reverse
-							dump(packet);
-							break;
-						default:
-							xprintf(PSTR("Unknown opt out type\n"));
-						}
-						break;
-					default:
-						xprintf(PSTR("Unknown opt out mode\n"));
-					}
-					OptOutMode=0;	// This is a one shot trigger, so clear it now.					
-				}
-				else
+			case 'Z' : // Databroadcast line. Scheduled packets first, then any databroadcast, then pages
+				if (ScheduleLine(packet))
+					break;
 				if (SendDataBroadcast(packet))
 				{
 					if (insert(packet,evenfield))	// If there is no databroadcast to send, insert the next normal line
 						return;
 				}
-				else				
-				{
-				
-// #ifdef opt_out_test	
-// The contents in here tests Softel opt out signals. It does this by stealing from the databroadcast packet
-// So if it is important that you don't lose packets then remove this block.
-// See the "O" command for more details
-					testOptRate++;	// The existing code should get here at 1Hz
-					if ((testOptRate>5 || OldOptRelays!=OptRelays) && false)	// Steal. (Disabled by adding FALSE!)
-					{
-						OldOptRelays=OptRelays;
-						testOptMode=(testOptMode+1)%4;
-						testOptRate=0;
-						WritePrefix(packet,8,31);
-						p=&packet[5];
-						*p++=0x64;			// 5 FT=4
-						*p++=0x49;			// 6 IAL=2
-						*p++=0xb6;			// 7 Address(0)=D
-						*p++=0x2f;			// 8 Address(1)=7
-						*p++=0x00;			// 9 CI
-/*						*p++=HamTab[testOptMode];			// 10 relays 1						
-						*p++=HamTab[(testOptMode+1)%4];	// 11 relays 2
-						*/
-						*p++=HamTab[OptRelays&0x0f];			// 10 relays 1						
-						*p++=HamTab[(OptRelays>>4)&0x0f];	// 11 relays 2
-						*p++='S';*p++='o';*p++='f';*p++='t';*p++='e';*p++='l';*p++=' '; // 12
-						*p++='D';*p++='l';*p++=' '; // 19
-						*p++='X';*p++='3';*p++='l';*p++=' '; // 22
-						*p++='S';*p++='u';*p++='b';*p++='t';*p++='i';*p++='t';*p++='l';*p++='e';*p++=' '; // 26
-						*p++='I';*p++='n';*p++='s';*p++='e';*p++='r';*p++='t';*p++='e';*p++='r'; //35
-						// Which leaves two checksum digits
-						// dump(packet);
-					}
-// #endif
-					// dump(packet);
-					Parity(packet,10);		// Do the parity and bit reverse, as databroadcast doesn't do it
-				}
 				break;
 			default: // Error! Don't know what to do. Make it quiet.
 				QuietLine(packet,0x06);
@@ -845,17 +979,16 @@ void FillFIFO(void)
 		{
 			fifoWriteIndex=(fifoWriteIndex+1)%MAXFIFOINDEX;
 			fifoLineCounter=0;
+			// The next call starts the block if we stop here.
+			// Don't start it now. When the ring is full, fifoWriteIndex is the block on air.
 			if (fifoWriteIndex==fifoReadIndex)
 			{
 				// xputs(PSTR("f")); // FIFO FULL WARNING
 				return;	// FIFO Full
 			}	
-			else
-			{
-				// Set the next SPI RAM address
-				fifoWriteAddress=fifoWriteIndex*FIFOBLOCKSIZE+fifoLineCounter*PACKETSIZE; 
-		//		SetSerialRamAddress(SPIRAM_WRITE, fifoWriteAddress); 	// Set FIFO next address
-			}
+			if ((fifoWriteIndex+MAXFIFOINDEX-fifoReadIndex)%MAXFIFOINDEX>=fifoDepth)
+				return;	// Deep enough
+			StartBlock();
 		}	
 		// xputc(fifoLineCounter+'a');	// show the current line number
 		
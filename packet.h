@@ -63,6 +63,9 @@
 
 #define PACKETSIZE 45
 
+// How many vbi lines per field. Not quite right. Odd field is 17 (6..22), Even is 18 (318..335).
+#define VBILINES	17
+
 /// Defines for SetHeaderControl parameter bit masks. C numbers refer to WST
 #define CTRL_C5_NEWFLASH_bm				0x0001	/* C5 */
 #define CTRL_C6_SUBTITLE_bm  			0x0002
@@ -85,8 +88,8 @@
 /// Additional VBIT specific control bits. Same as MRG S: Set Page Status
 #define CTRL_TIMEDPAGE_bm				0x0400	/* ? Probably will do this a different way */
 #define CTRL_REPLACEINCOMING_bm			0x0800	/* N/A Used for bridging */
-#define CTRL_RESERVED0_bm				0x1000	/* ? */
-#define CTRL_RESERVED1_bm				0x2000	/* ? */
+#define CTRL_KEEPBLANKROWS_bm			0x1000	/* Send blank rows even if C4 is set. See insert */
+#define CTRL_DELTA_bm					0x2000	/* Row-delta repeat. Header and changed rows only. From GetPage */
 #define CTRL_C4_ERASEBIT_bm				0x4000	/* Erase all rows of the previous transmission of the page */
 #define CTRL_ENABLETX_bm				0x8000	/* Set this to enable transmission */
 
@@ -109,6 +112,50 @@ void FillerPacket(char *buffer);
  */
 void FillFIFO(void);
 
+/** The page that a magazine is part way through sending.
+ * If anything else puts a header out in that magazine, the page has to be started again.
+ */
+typedef struct _OPENPAGE_
+{
+	uint8_t mag;		/// 1..8 or 0 if no page is open
+	uint8_t page;
+	uint16_t subcode;
+	uint16_t control;
+} OPENPAGE;
+
+/**\brief Which page was open when a FIFO block started
+ * \param block : FIFO block index 0..MAXFIFOINDEX-1
+ * \param open : Returns the page. open->mag is 0 if there wasn't one.
+ */
+void GetOpenPage(uint8_t block, OPENPAGE *open);
+
+/**\brief Makes a header packet. The caption is normally g_Header
+ * The encoded caption is cached by its address. Call InvalidateHeader after changing its contents.
+ */
+void Header(char *packet ,unsigned char mag, unsigned char page, unsigned int subcode,
+			unsigned int control, char *caption);
+
+/**\brief Writes the clock run in, framing code and MRAG
+ */
+void WritePrefix(char *packet, uint8_t mag, uint8_t row);
+
+/**\brief Adds odd parity from offset to the end and reverses the bits for transmission
+ */
+void Parity(char *packet, uint8_t offset);
+
+/**\brief Copy an OL line of a tti page into a packet
+ * \return The row number or 0xff if the line is bad
+ */
+unsigned char copyOL(char *packet, char *textline, uint8_t length);
+
+/**\brief A line that no decoder will take as teletext
+ */
+void QuietLine(char * packet, uint8_t code);
+
+/**\brief Call this after changing g_Header so that the header gets encoded again
+ */
+void InvalidateHeader(void);
+
 /// Dataline Output Actions array. 
 extern char g_OutputActions[2][18];
 extern char g_Header[32];
@@ -122,7 +169,4 @@ extern FATFS Fatfs[1];
 extern FIL pagefileFIL, listFIL;
 
 extern int OptRelays;			/* Holds the current state of the opt out relay signals */
-
-extern unsigned char OptOutMode;	// Which ATP950 mode
-extern unsigned char OptOutType;	// One of the OPTOUT values
 #endif
\ No newline at end of file
@@ -94,10 +94,18 @@ unsigned char ParseLine(PAGE *page, char *str)
 			page->control=n;
 		}
 		break;
+	case 'C': // CT,nn,<T|C> - cycle time. The directory reports it.
+		if (str[1]=='T')
+		{
+			ptr=&str[3];
+			xatoi(&ptr,&n);
+			page->time=n;
+			if (*ptr==',' && (ptr[1]=='C' || ptr[1]=='T'))
+				page->timerMode=ptr[1];
+		}
+		break;
 	//Why don't we decode these entries?
 	// 1) Either we don't need them, or we do need them later but we need to save memory 
-	case 'C':; // CT,nn,<T|C> - cycle time
-		break;
 	case 'S':; // SP - filename or SC - subcode
 		break;
 	case 'M':; // MS - no idea
@@ -112,7 +120,7 @@ unsigned char ParseLine(PAGE *page, char *str)
 		if (str[1]=='D') // RD,<n> - redirect. Read the data lines from the FIFO rather than the page file OL commands.
 		// The idea is that we can use a reserved area of RAM for dynamic pages.
 		// These are pages that change a lot and don't suit being stored in SD card
-		// 1) Read the RD parameter, which is a number between 0 and SRAMPAGECOUNT (actually 0x0e (14) atm)
+		// 1) Read the RD parameter, which is a number between 0 and SRAMPAGECOUNT (actually 4 atm)
 		// We will store this in the page structure ready for the packetizer to grab the SRAM 
 		str[1]='0';
 		str[2]='x';
@@ -175,7 +183,18 @@ void ClearPage(PAGE *page)
 	page->page=0xff;
 	page->subpage=0xff;
 	page->timerMode='T';
+	page->time=0;
 	page->control=0x8000;	// Default to parallel transmission
 	page->filesize=0;
 	page->redirect=0xff;	// Which SRAM page to redirect input from. 0..14 or 0xff for None
 } // ClearPage
+
+uint32_t PageHash(uint32_t hash, const char *data, uint16_t len)
+{
+	while (len--)
+	{
+		hash^=(uint8_t)*data++;
+		hash*=0x01000193UL;	// FNV prime
+	}
+	return hash;
+} // PageHash
@@ -64,4 +64,15 @@ unsigned char ParsePage(PAGE *page, char *filename);
  */
 void ClearPage(PAGE *page);
 
+// Start value for PageHash
+#define PAGEHASHSTART 0x811c9dc5UL
+
+/** Add bytes to a page content hash (32 bit FNV-1a). This goes in pages.idx.
+ * \param hash : Hash so far. Start at PAGEHASHSTART.
+ * \param data : Bytes of the page, exactly as they are in pages.all
+ * \param len : Number of bytes
+ * \return The new hash
+ */
+uint32_t PageHash(uint32_t hash, const char *data, uint16_t len);
+
 #endif
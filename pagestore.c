@@ -0,0 +1,227 @@
+/** ***************************************************************************
+ * Description       : VBIT: Page store on the SD card using FatFs
+ * Compiler          : GCC
+ *
+ * Copyright (C) 2012, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+#include "packet.h"
+#include "pagestore.h"
+
+// The file objects are pagefileFIL and listFIL in packet.c.
+// They are shared with the display list scanner which uses them at startup.
+// They are opened for writing too, so that pages can be added without closing them.
+
+static DWORD appendStart;	// Where the new page starts in pages.all
+static DWORD readPtr;		// Where the transmission side was before the append
+static FRESULT appendRes;
+static uint8_t storeOpen;
+
+uint8_t PageStoreOpen(void)
+{
+	FRESULT res;
+	uint32_t magic;
+	uint16_t size;
+	uint32_t version;
+	res=f_open(&listFIL,"pages.idx",FA_READ|FA_WRITE);
+	if (res)
+	{
+		xprintf(PSTR("[pagestore]Epic Fail. Can not open pages.idx\n"));
+		put_rc(res);
+		return res;
+	}
+	res=f_open(&pagefileFIL,"pages.all",FA_READ|FA_WRITE);
+	if (res)
+	{
+		xprintf(PSTR("[pagestore]Epic Fail. Can not open pages.all\n"));
+		put_rc(res);
+		f_close(&listFIL);
+		return res;
+	}
+	if (PageStoreGetIndex(0,&magic,&size) || magic!=PAGEINDEXMAGIC ||
+		PageStoreGetHash(0,&version) || version!=PAGEINDEXVERSION)
+	{
+		xprintf(PSTR("[pagestore]pages.idx is in an old format. Use the C command to rebuild it\n"));
+		f_close(&pagefileFIL);
+		f_close(&listFIL);
+		return FR_INT_ERR;
+	}
+	storeOpen=1;
+	return 0;
+} // PageStoreOpen
+
+void PageStoreClose(void)
+{
+	storeOpen=0;
+	f_close(&pagefileFIL);
+	f_close(&listFIL);
+} // PageStoreClose
+
+uint8_t PageStoreIsOpen(void)
+{
+	return storeOpen;
+} // PageStoreIsOpen
+
+uint8_t PageStoreRefresh(void)
+{
+	DWORD fileptr;
+	FRESULT res;
+	// Re-open pages.all so that FatFs picks up the new size, and go back to where we were
+	fileptr=pagefileFIL.fptr;
+	f_close(&pagefileFIL);
+	res=f_open(&pagefileFIL,"pages.all",FA_READ|FA_WRITE);
+	if (res)
+		return res;
+	return f_lseek(&pagefileFIL,fileptr);
+} // PageStoreRefresh
+
+uint8_t PageStoreGetIndex(uint16_t ix, uint32_t *seekptr, uint16_t *pagesize)
+{
+	PAGEINDEXRECORD ixRec;
+	UINT charcount;
+	FRESULT res;
+	res=f_lseek(&listFIL,(DWORD)ix*PAGEINDEXRECORDSIZE);
+	if (res)
+		return res;
+	res=f_read(&listFIL,&ixRec,PAGEINDEXRECORDSIZE,&charcount);
+	if (res)
+		return res;
+	if (charcount!=PAGEINDEXRECORDSIZE)
+		return FR_INT_ERR;	// Off the end of the index
+	*seekptr=ixRec.seekptr;
+	*pagesize=ixRec.pagesize;
+	return 0;
+} // PageStoreGetIndex
+
+uint8_t PageStoreGetHash(uint16_t ix, uint32_t *hash)
+{
+	PAGEINDEXRECORD ixRec;
+	UINT charcount;
+	FRESULT res;
+	res=f_lseek(&listFIL,(DWORD)ix*PAGEINDEXRECORDSIZE);
+	if (res)
+		return res;
+	res=f_read(&listFIL,&ixRec,PAGEINDEXRECORDSIZE,&charcount);
+	if (res)
+		return res;
+	if (charcount!=PAGEINDEXRECORDSIZE)
+		return FR_INT_ERR;
+	*hash=ixRec.hash;
+	return 0;
+} // PageStoreGetHash
+
+uint8_t PageStoreAppendBegin(uint32_t *seekptr)
+{
+	readPtr=pagefileFIL.fptr;
+	appendStart=pagefileFIL.fsize;
+	*seekptr=appendStart;
+	appendRes=f_lseek(&pagefileFIL,appendStart);	// Locate the end of the file
+	return appendRes;
+} // PageStoreAppendBegin
+
+uint8_t PageStoreAppendData(const char *data, uint16_t len)
+{
+	UINT charcount;
+	if (appendRes)
+		return appendRes;
+	appendRes=f_write(&pagefileFIL,data,len,&charcount);
+	if (!appendRes && charcount!=len)
+		appendRes=FR_DENIED;	// Disk full
+	return appendRes;
+} // PageStoreAppendData
+
+void PageStoreAppendFail(void)
+{
+	if (!appendRes)
+		appendRes=FR_INT_ERR;
+} // PageStoreAppendFail
+
+uint8_t PageStoreAppendEnd(uint32_t hash, uint16_t *ix)
+{
+	FRESULT res=appendRes;
+	UINT charcount;
+	DWORD addr;
+	DWORD listPtr;
+	uint8_t rec[PAGEINDEXRECORDSIZE];
+	uint16_t pagesize=(uint16_t)(pagefileFIL.fptr-appendStart);
+	// The page goes on the card before the index points at it
+	if (!res)
+		res=f_sync(&pagefileFIL);
+	if (!res)
+	{
+		rec[0]=appendStart;rec[1]=appendStart>>8;rec[2]=appendStart>>16;rec[3]=appendStart>>24;
+		rec[4]=pagesize;rec[5]=pagesize>>8;
+		rec[6]=hash;rec[7]=hash>>8;rec[8]=hash>>16;rec[9]=hash>>24;
+		listPtr=listFIL.fptr;
+		addr=listFIL.fsize;		// This is the address in the file
+		res=f_lseek(&listFIL,addr);	// Locate the end of the file
+		if (!res)
+			res=f_write(&listFIL,rec,PAGEINDEXRECORDSIZE,&charcount);
+		if (!res)
+			res=f_sync(&listFIL);
+		f_lseek(&listFIL,listPtr);
+		*ix=(uint16_t)(addr/PAGEINDEXRECORDSIZE);
+	}
+	if (res)
+	{
+		// Leave nothing behind
+		f_lseek(&pagefileFIL,appendStart);
+		f_truncate(&pagefileFIL);
+		f_sync(&pagefileFIL);
+	}
+	f_lseek(&pagefileFIL,readPtr);	// Back to where the transmission side was
+	return res;
+} // PageStoreAppendEnd
+
+uint8_t PageStoreDropIndex(uint16_t ix)
+{
+	FRESULT res;
+	UINT charcount;
+	DWORD listPtr=listFIL.fptr;
+	uint8_t size[2]={0,0};
+	res=f_lseek(&listFIL,(DWORD)ix*PAGEINDEXRECORDSIZE+4);	// pagesize
+	if (!res)
+		res=f_write(&listFIL,size,sizeof(size),&charcount);
+	if (!res)
+		res=f_sync(&listFIL);
+	f_lseek(&listFIL,listPtr);
+	return res;
+} // PageStoreDropIndex
+
+uint8_t PageStoreSeek(uint32_t ptr)
+{
+	return f_lseek(&pagefileFIL,ptr);
+} // PageStoreSeek
+
+uint32_t PageStoreTell(void)
+{
+	return pagefileFIL.fptr;
+} // PageStoreTell
+
+char *PageStoreGetLine(char *buf, uint8_t len, uint8_t *count)
+{
+	char *str;
+	str=f_gets(buf,len,&pagefileFIL);
+	if (str)
+		*count=(uint8_t)strlen(str);
+	else
+		*count=0;
+	return str;
+} // PageStoreGetLine
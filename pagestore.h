@@ -0,0 +1,144 @@
+/** ***************************************************************************
+ * Description       : VBIT: Page store access
+ * Compiler          : GCC
+ *
+ * Copyright (C) 2012, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+/*
+What is the page store?
+The page store is pages.all (every page, one after the other, in tti format)
+and pages.idx (a binary array of 10 byte records: 4 byte seek pointer, 2 byte size and
+4 byte PageHash of the page contents).
+The packetizer only needs a few operations on it, so they are gathered here
+so that the storage can be swapped without touching packet.c.
+
+There are two implementations:
+pagestore.c      - FatFs on the SD card. This is the one the XMEGA uses.
+pagestore_mmap.c - For host builds. Maps both files into memory so that
+                   lines are handed over as pointers into the mapping without any copying.
+                   make hosttest builds it and runs test/pagestore_test.c against it.
+
+Warning: The line returned by PageStoreGetLine may point into the store itself.
+It must be treated as read only. If you need to modify it (ParseLine does), copy it first.
+*/
+#ifndef _PAGESTORE_H_
+#define _PAGESTORE_H_
+
+#include <stdint.h>
+
+/** Size of a record in pages.idx. Don't use sizeof(PAGEINDEXRECORD), the host will pad it.
+ */
+#define PAGEINDEXRECORDSIZE 10
+
+/** Record 0 of pages.idx is a header, so that an index left over from the old 6 byte
+ * format isn't read as this one. Its seekptr is PAGEINDEXMAGIC, its pagesize is 0 so
+ * that nothing treats it as a page, and its hash is PAGEINDEXVERSION. Pages start at record 1.
+ * An old pages.idx starts with the seekptr of the first page, which is 0.
+ */
+#define PAGEINDEXMAGIC		0x58444956UL	// "VIDX"
+#define PAGEINDEXVERSION	2
+
+/** Open pages.all and pages.idx in the current folder (onair)
+ * \return 0 if OK, >0 if failed. An index without the header counts as failed.
+ */
+uint8_t PageStoreOpen(void);
+
+/** Close the page store
+ */
+void PageStoreClose(void);
+
+/** \return 1 if PageStoreOpen has been called and it worked
+ */
+uint8_t PageStoreIsOpen(void);
+
+/** Call this after pages.all has been written to through some other file
+ * so that the transmission side sees the new data. PageStoreAppendEnd doesn't need it.
+ * \return 0 if OK, >0 if failed
+ */
+uint8_t PageStoreRefresh(void);
+
+/** Fetch a record from pages.idx
+ * \param ix : Record number (not the address!)
+ * \param seekptr : Returns the offset of the page in pages.all
+ * \param pagesize : Returns the number of bytes in the page
+ * \return 0 if OK, >0 if failed
+ */
+uint8_t PageStoreGetIndex(uint16_t ix, uint32_t *seekptr, uint16_t *pagesize);
+
+/** Fetch the content hash from a record in pages.idx
+ * \param ix : Record number
+ * \param hash : Returns the PageHash of the page
+ * \return 0 if OK, >0 if failed
+ */
+uint8_t PageStoreGetHash(uint16_t ix, uint32_t *hash);
+
+/** Add a page to the end of pages.all and its record to pages.idx.
+ * PageStoreAppendBegin, PageStoreAppendData as often as needed, then PageStoreAppendEnd.
+ * The files stay open, so the transmission side carries on from where it was.
+ * Nothing else may use the page store in between (so no TaskYield).
+ * \param seekptr : Returns the offset of the new page in pages.all
+ * \return 0 if OK, >0 if failed. Call PageStoreAppendEnd anyway.
+ */
+uint8_t PageStoreAppendBegin(uint32_t *seekptr);
+
+/** Add to the page started by PageStoreAppendBegin
+ * \return 0 if OK, >0 if failed. Call PageStoreAppendEnd anyway.
+ */
+uint8_t PageStoreAppendData(const char *data, uint16_t len);
+
+/** Give up on the page started by PageStoreAppendBegin, for when the caller can't supply
+ * the rest of it. PageStoreAppendEnd then fails and cuts pages.all back. Call it anyway.
+ */
+void PageStoreAppendFail(void);
+
+/** Finish the page. If anything failed then pages.all is cut back and nothing is indexed.
+ * \param hash : PageHash of everything that was added
+ * \param ix : Returns the record number of the new entry in pages.idx
+ * \return 0 if OK, >0 if failed
+ */
+uint8_t PageStoreAppendEnd(uint32_t hash, uint16_t *ix);
+
+/** Take a page out of pages.idx by setting its size to 0. ScanPageList skips it after that.
+ * The page stays in pages.all. Only the C command gets the space back.
+ * \param ix : Record number
+ * \return 0 if OK, >0 if failed
+ */
+uint8_t PageStoreDropIndex(uint16_t ix);
+
+/** Set the read position in pages.all
+ * \param ptr : Offset from the start of pages.all
+ * \return 0 if OK, >0 if failed
+ */
+uint8_t PageStoreSeek(uint32_t ptr);
+
+/** \return The current read position in pages.all
+ */
+uint32_t PageStoreTell(void);
+
+/** Get the next line from pages.all, including the terminating \n.
+ * \param buf : Buffer that may be used to hold the line
+ * \param len : Size of buf. No more than len-1 characters are returned.
+ * \param count : Returns the number of characters in the line
+ * \return Pointer to the line (buf or somewhere in the store) or 0 if there is nothing to read
+ */
+char *PageStoreGetLine(char *buf, uint8_t len, uint8_t *count);
+
+#endif
@@ -0,0 +1,282 @@
+/** ***************************************************************************
+ * Description       : VBIT: Memory mapped page store for host builds
+ * Compiler          : GCC
+ *
+ * Copyright (C) 2012, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+/*
+This is the Linux version of pagestore.c
+Instead of f_lseek and f_gets into a buffer, pages.all and pages.idx are mapped
+read only and PageStoreGetLine returns a pointer straight into the mapping.
+The only system calls on the transmission path are the fstat calls made when
+someone asks for something past the end of what we have mapped.
+
+Remapping is safe because the packetizer only keeps offsets, never pointers,
+between calls. Uploads only ever append to the files, through their own descriptors.
+*/
+#ifndef __AVR__
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include "pagestore.h"
+
+typedef struct
+{
+	const char *name;
+	int fd;
+	char *base;		// Start of the mapping, or 0 if the file is empty
+	size_t size;	// Number of bytes mapped
+} MAPPEDFILE;
+
+static MAPPEDFILE pageAll={"pages.all",-1,0,0};
+static MAPPEDFILE pageIdx={"pages.idx",-1,0,0};
+static uint32_t readPtr;	// Offset of the next line in pages.all
+static int appendFd=-1;		// pages.all, open to add a page
+static off_t appendStart;
+static off_t appendEnd;
+static uint8_t appendFailed;
+
+static void UnmapFile(MAPPEDFILE *m)
+{
+	if (m->base)
+		munmap(m->base,m->size);
+	m->base=0;
+	m->size=0;
+} // UnmapFile
+
+/** Map the file, or map it again if it has changed size
+ * \return 0 if OK, 1 if failed
+ */
+static uint8_t MapFile(MAPPEDFILE *m)
+{
+	struct stat st;
+	void *p;
+	if (m->fd<0)
+	{
+		m->fd=open(m->name,O_RDONLY);
+		if (m->fd<0)
+			return 1;
+	}
+	if (fstat(m->fd,&st))
+		return 1;
+	if (m->base && (size_t)st.st_size==m->size)
+		return 0;	// Nothing changed
+	UnmapFile(m);
+	if (st.st_size==0)
+		return 0;	// Can't map an empty file, but it isn't an error
+	p=mmap(0,st.st_size,PROT_READ,MAP_SHARED,m->fd,0);
+	if (p==MAP_FAILED)
+		return 1;
+	madvise(p,st.st_size,MADV_WILLNEED);
+	m->base=(char*)p;
+	m->size=st.st_size;
+	return 0;
+} // MapFile
+
+static void CloseFile(MAPPEDFILE *m)
+{
+	UnmapFile(m);
+	if (m->fd>=0)
+		close(m->fd);
+	m->fd=-1;
+} // CloseFile
+
+uint8_t PageStoreOpen(void)
+{
+	uint32_t magic;
+	uint16_t size;
+	uint32_t version;
+	if (MapFile(&pageIdx))
+		return 1;
+	if (MapFile(&pageAll))
+	{
+		CloseFile(&pageIdx);
+		return 1;
+	}
+	if (PageStoreGetIndex(0,&magic,&size) || magic!=PAGEINDEXMAGIC ||
+		PageStoreGetHash(0,&version) || version!=PAGEINDEXVERSION)
+	{
+		PageStoreClose();	// No header. It's an old index
+		return 1;
+	}
+	readPtr=0;
+	return 0;
+} // PageStoreOpen
+
+void PageStoreClose(void)
+{
+	CloseFile(&pageAll);
+	CloseFile(&pageIdx);
+} // PageStoreClose
+
+uint8_t PageStoreIsOpen(void)
+{
+	return pageIdx.fd>=0;
+} // PageStoreIsOpen
+
+uint8_t PageStoreRefresh(void)
+{
+	return MapFile(&pageAll) | MapFile(&pageIdx);
+} // PageStoreRefresh
+
+uint8_t PageStoreGetIndex(uint16_t ix, uint32_t *seekptr, uint16_t *pagesize)
+{
+	const uint8_t *p;
+	size_t addr=(size_t)ix*PAGEINDEXRECORDSIZE;
+	if (addr+PAGEINDEXRECORDSIZE>pageIdx.size)
+	{
+		// The index has probably grown since we mapped it. Page data is written first
+		if (PageStoreRefresh() || addr+PAGEINDEXRECORDSIZE>pageIdx.size)
+			return 1;
+	}
+	// Records are packed little endian, as written by the XMEGA
+	p=(const uint8_t *)pageIdx.base+addr;
+	*seekptr=(uint32_t)p[0] | ((uint32_t)p[1]<<8) | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24);
+	*pagesize=(uint16_t)(p[4] | (p[5]<<8));
+	return 0;
+} // PageStoreGetIndex
+
+uint8_t PageStoreGetHash(uint16_t ix, uint32_t *hash)
+{
+	const uint8_t *p;
+	size_t addr=(size_t)ix*PAGEINDEXRECORDSIZE;
+	if (addr+PAGEINDEXRECORDSIZE>pageIdx.size && (PageStoreRefresh() || addr+PAGEINDEXRECORDSIZE>pageIdx.size))
+		return 1;
+	p=(const uint8_t *)pageIdx.base+addr+6;
+	*hash=(uint32_t)p[0] | ((uint32_t)p[1]<<8) | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24);
+	return 0;
+} // PageStoreGetHash
+
+uint8_t PageStoreAppendBegin(uint32_t *seekptr)
+{
+	struct stat st;
+	appendFailed=1;
+	appendStart=0;
+	appendFd=open(pageAll.name,O_WRONLY);
+	if (appendFd<0 || fstat(appendFd,&st) || lseek(appendFd,st.st_size,SEEK_SET)<0)
+		return 1;
+	appendStart=appendEnd=st.st_size;
+	*seekptr=(uint32_t)appendStart;
+	appendFailed=0;
+	return 0;
+} // PageStoreAppendBegin
+
+uint8_t PageStoreAppendData(const char *data, uint16_t len)
+{
+	if (appendFailed)
+		return 1;
+	if (write(appendFd,data,len)!=(ssize_t)len)
+		appendFailed=1;
+	else
+		appendEnd+=len;
+	return appendFailed;
+} // PageStoreAppendData
+
+void PageStoreAppendFail(void)
+{
+	appendFailed=1;
+} // PageStoreAppendFail
+
+uint8_t PageStoreAppendEnd(uint32_t hash, uint16_t *ix)
+{
+	uint8_t rec[PAGEINDEXRECORDSIZE];
+	uint32_t seekptr=(uint32_t)appendStart;
+	uint16_t pagesize=(uint16_t)(appendEnd-appendStart);
+	struct stat st;
+	int fd=-1;
+	uint8_t failed=appendFailed;
+	if (!failed)
+	{
+		rec[0]=seekptr;rec[1]=seekptr>>8;rec[2]=seekptr>>16;rec[3]=seekptr>>24;
+		rec[4]=pagesize;rec[5]=pagesize>>8;
+		rec[6]=hash;rec[7]=hash>>8;rec[8]=hash>>16;rec[9]=hash>>24;
+		fd=open(pageIdx.name,O_WRONLY|O_APPEND);
+		failed=fd<0 || fstat(fd,&st);
+	}
+	if (!failed)
+	{
+		*ix=(uint16_t)(st.st_size/PAGEINDEXRECORDSIZE);
+		failed=write(fd,rec,sizeof(rec))!=sizeof(rec);
+	}
+	if (fd>=0)
+		close(fd);
+	if (appendFd>=0)
+	{
+		if (failed)
+			ftruncate(appendFd,appendStart);	// Leave nothing behind
+		close(appendFd);
+	}
+	appendFd=-1;
+	if (failed)
+		return 1;
+	return PageStoreRefresh();
+} // PageStoreAppendEnd
+
+uint8_t PageStoreDropIndex(uint16_t ix)
+{
+	static const uint8_t size[2]={0,0};
+	uint8_t failed;
+	int fd=open(pageIdx.name,O_WRONLY);
+	if (fd<0)
+		return 1;
+	// The mapping is shared, so the transmission side sees it straight away
+	failed=pwrite(fd,size,sizeof(size),(off_t)ix*PAGEINDEXRECORDSIZE+4)!=sizeof(size);
+	close(fd);
+	return failed;
+} // PageStoreDropIndex
+
+uint8_t PageStoreSeek(uint32_t ptr)
+{
+	if (ptr>pageAll.size && (MapFile(&pageAll) || ptr>pageAll.size))
+		return 1;
+	readPtr=ptr;
+	return 0;
+} // PageStoreSeek
+
+uint32_t PageStoreTell(void)
+{
+	return readPtr;
+} // PageStoreTell
+
+char *PageStoreGetLine(char *buf, uint8_t len, uint8_t *count)
+{
+	char *line;
+	char *end;
+	size_t avail;
+	(void)buf;	// Not needed. That is the point.
+	*count=0;
+	if (readPtr>=pageAll.size || len<2)
+		return 0;
+	line=pageAll.base+readPtr;
+	avail=pageAll.size-readPtr;
+	if (avail>(size_t)(len-1))
+		avail=len-1;	// Same limit as f_gets
+	end=memchr(line,'\n',avail);
+	*count=end?(uint8_t)(end-line+1):(uint8_t)avail;
+	readPtr+=*count;
+	return line;
+} // PageStoreGetLine
+
+#endif
@@ -0,0 +1,105 @@
+/*****************************************************************************
+ * Description       : Lock free rings for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file ring.c
+ * Lock free SPSC rings
+ */
+
+#include "ring.h"
+
+// Each side reads the other side's index with acquire and publishes its own with release.
+// On the XMEGA these are plain byte loads and stores, but the compiler can't move the
+// buffer access past them. They also make the ring safe between two threads on a host.
+#define LOAD(x)		__atomic_load_n(&(x),__ATOMIC_ACQUIRE)
+#define STORE(x,v)	__atomic_store_n(&(x),(v),__ATOMIC_RELEASE)
+
+void RingInit(RING *ring, uint8_t *buf, uint8_t size)
+{
+	ring->buf=buf;
+	ring->mask=size-1;
+	ring->head=0;
+	ring->tail=0;
+} // RingInit
+
+uint8_t RingCount(RING *ring)
+{
+	return LOAD(ring->head)-ring->tail;
+} // RingCount
+
+uint8_t RingFree(RING *ring)
+{
+	return ring->mask+1-(uint8_t)(ring->head-LOAD(ring->tail));
+} // RingFree
+
+uint8_t RingPut(RING *ring, uint8_t c)
+{
+	return RingPutBulk(ring,&c,1)?0:1;
+} // RingPut
+
+uint8_t RingGet(RING *ring, uint8_t *c)
+{
+	return RingGetBulk(ring,c,1)?0:1;
+} // RingGet
+
+uint8_t RingPutBulk(RING *ring, const uint8_t *data, uint8_t len)
+{
+	uint8_t head=ring->head;
+	uint8_t n;
+	uint8_t i;
+	n=RingFree(ring);
+	if (len>n)
+		len=n;
+	for (i=0;i<len;i++)
+		ring->buf[(uint8_t)(head+i)&ring->mask]=data[i];
+	STORE(ring->head,(uint8_t)(head+len));
+	return len;
+} // RingPutBulk
+
+uint8_t RingPeek(RING *ring, uint8_t *data, uint8_t len)
+{
+	uint8_t tail=ring->tail;
+	uint8_t n;
+	uint8_t i;
+	n=RingCount(ring);
+	if (len>n)
+		len=n;
+	for (i=0;i<len;i++)
+		data[i]=ring->buf[(uint8_t)(tail+i)&ring->mask];
+	return len;
+} // RingPeek
+
+uint8_t RingGetBulk(RING *ring, uint8_t *data, uint8_t len)
+{
+	len=RingPeek(ring,data,len);
+	STORE(ring->tail,(uint8_t)(ring->tail+len));
+	return len;
+} // RingGetBulk
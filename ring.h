@@ -0,0 +1,97 @@
+/*****************************************************************************
+ * Description       : Lock free rings for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Lock free single producer, single consumer byte rings.
+ * One side (say an interrupt) only ever puts and the other side only ever gets.
+ * The producer only writes head and the consumer only writes tail, and both are
+ * single bytes, so neither side ever needs to turn the interrupts off.
+ * The indexes run freely from 0 to 255 and are masked when the buffer is used,
+ * so head-tail is the number of bytes waiting. That is why the size must be a
+ * power of two and no more than 128.
+ * make hosttest runs test/ring_test.c, which pushes data through a ring between two threads.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \brief Lock free SPSC rings
+*/
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdint.h>
+
+typedef struct
+{
+	uint8_t *buf;
+	uint8_t mask;		// Size-1
+	uint8_t head;		// Next byte to put. Only the producer writes it.
+	uint8_t tail;		// Next byte to get. Only the consumer writes it.
+} RING;
+
+/** Set up a ring. Call it before either side uses it.
+ * \param ring : The ring
+ * \param buf : Storage for the ring
+ * \param size : Size of buf. 2, 4, 8, 16, 32, 64 or 128
+ */
+void RingInit(RING *ring, uint8_t *buf, uint8_t size);
+
+/** Consumer side. \return Number of bytes waiting
+ */
+uint8_t RingCount(RING *ring);
+
+/** Producer side. \return Number of bytes that can be put
+ */
+uint8_t RingFree(RING *ring);
+
+/** Put one byte
+ * \return 0 if OK, 1 if the ring is full
+ */
+uint8_t RingPut(RING *ring, uint8_t c);
+
+/** Get one byte
+ * \return 0 if OK, 1 if the ring is empty
+ */
+uint8_t RingGet(RING *ring, uint8_t *c);
+
+/** Put as many bytes as will fit
+ * \return Number of bytes put
+ */
+uint8_t RingPutBulk(RING *ring, const uint8_t *data, uint8_t len);
+
+/** Get up to len bytes
+ * \return Number of bytes got
+ */
+uint8_t RingGetBulk(RING *ring, uint8_t *data, uint8_t len);
+
+/** Copy up to len bytes without taking them out of the ring
+ * \return Number of bytes copied
+ */
+uint8_t RingPeek(RING *ring, uint8_t *data, uint8_t len);
+
+#endif
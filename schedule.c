@@ -0,0 +1,91 @@
+/*****************************************************************************
+ * Description       : Periodic packet scheduler for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file schedule.c
+ * Reserved lines for periodic packets
+ */
+
+#include "schedule.h"
+
+typedef struct
+{
+	uint8_t period;		// Fields between goes
+	uint8_t count;		// Lines each go. 0 is off
+	uint8_t left;		// Lines still owed. Kept until they are used, or the service says it has nothing.
+} SCHEDULE;
+
+static SCHEDULE schedule[SCHEDCOUNT]={{50,1,0},{1,0,0}};
+static uint32_t scheduleField;	// Air field of the block being loaded
+
+uint8_t SetSchedule(uint8_t service, uint8_t period, uint8_t count)
+{
+	if (service>=SCHEDCOUNT || !period || count>VBILINES)
+		return 1;
+	schedule[service].period=period;
+	schedule[service].count=count;
+	schedule[service].left=0;
+	return 0;
+} // SetSchedule
+
+void ScheduleBlock(uint32_t airfield)
+{
+	uint8_t i;
+	scheduleField=airfield;
+	for (i=0;i<SCHEDCOUNT;i++)
+		if (schedule[i].count && airfield%schedule[i].period==0)
+			schedule[i].left=schedule[i].count;
+} // ScheduleBlock
+
+uint8_t ScheduleLine(char *packet)
+{
+	SCHEDULE *s;
+	if (OptOutLine(packet,scheduleField))
+		return 1;
+	s=&schedule[SCHED_830F1];
+	if (s->left)
+	{
+		s->left--;
+		Packet830F1(packet,FieldToUTC(scheduleField),FieldToMJD(scheduleField));
+		return 1;
+	}
+	s=&schedule[SCHED_DATABROADCAST];
+	if (s->left)
+	{
+		if (!SendDataBroadcast(packet))
+		{
+			s->left--;
+			return 1;
+		}
+		s->left=0;	// Nothing waiting. Give the lines back to the pages.
+	}
+	return 0;
+} // ScheduleLine
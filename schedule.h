@@ -0,0 +1,79 @@
+/*****************************************************************************
+ * Description       : Periodic packet scheduler for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Service packets that have to go out at a steady rate get lines reserved for them
+ * ahead of the pages. A service has a period in fields and a number of lines.
+ * In every field where FieldCount%period is 0 it is owed that many lines, and it takes
+ * the first insert or Z lines of the FIFO block that goes out on that field.
+ * Lines that a service can't use (no databroadcast waiting) go back to the pages.
+ *
+ * Services:
+ * 8/30 format 1   - Default once a second, with the UTC and MJD of the field it goes out on.
+ * Databroadcast   - 8/31 from the databroadcast buffer. Default 0 (off), so it
+ *                   only gets the Z lines as before.
+ *
+ * Opt-out triggers (optout.c) due on the field come before everything else.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \brief Reserved lines for periodic packets
+*/
+#ifndef _SCHEDULE_H_
+#define _SCHEDULE_H_
+
+#include "avr_compiler.h"
+#include <avr/pgmspace.h>
+#include "xitoa.h"
+#include "vbit.h"
+
+#define SCHED_830F1			0
+#define SCHED_DATABROADCAST	1
+#define SCHEDCOUNT			2
+
+/** Set the rate of a service
+ * \param service : SCHED_830F1 or SCHED_DATABROADCAST
+ * \param period : Fields between goes 1..255
+ * \param count : Lines each go. 0 turns it off
+ * \return 0 if OK, 1 if a parameter is out of range
+ */
+uint8_t SetSchedule(uint8_t service, uint8_t period, uint8_t count);
+
+/** Work out which services are owed lines in a new FIFO block
+ * \param airfield : The field that the block will go out on
+ */
+void ScheduleBlock(uint32_t airfield);
+
+/** Offer a line to the scheduled services
+ * \param packet : Gets the packet, ready to go, if a service wants the line
+ * \return 1 if the line was taken, 0 if it is free for the pages
+ */
+uint8_t ScheduleLine(char *packet);
+
+#endif
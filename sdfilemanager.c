@@ -23,6 +23,8 @@
  * this software.
  *************************************************************************** **/
 #include "sdfilemanager.h"
+#include "fastext.h"
+#include "pagestore.h"
 
 extern FATFS Fatfs[1];			/* File system object for each logical drive */
 FILINFO Finfo;
@@ -53,6 +55,7 @@ static void put_rc (FRESULT rc)
 void SDCreateLists(int mag, unsigned int pagecount)
 {
 	uint32_t p1,p2;
+	DWORD seekptr;	// Start of the page in pages.all
 	// FIL file[MAXMAG];		/* Array of output files */
 	FIL myfile;
 	FIL pagesfile;
@@ -61,11 +64,13 @@ void SDCreateLists(int mag, unsigned int pagecount)
 	DIR dir;			/* Directory object */
 	UINT s1, s2;	
 	char filename[80];
-	char str[80];
+	char str[FASTEXTENDSIZE];	// Big enough for the FX and FL lines too
 	char *ptr=0;
 	FRESULT res;	
 	FATFS *fs;
 	PAGE page;
+	uint32_t hash;	// PageHash of the page as it goes into pages.all
+	uint16_t size;
 	BYTE drive=0;
 	PAGE *pageptr=&page;
 	UINT charcount;
@@ -109,8 +114,9 @@ void SDCreateLists(int mag, unsigned int pagecount)
 
 	// This is a binary version fixed field length version of the pages index
 	// that should be quicker to use as a random access index
-	// Each entry consists of the seek pointer (32 bits) to a page in pages.all
-	// and the file size (16 bits)
+	// Each entry consists of the seek pointer (32 bits) to a page in pages.all,
+	// the file size (16 bits) and the content hash (32 bits)
+	// The first entry is the header. See PAGEINDEXMAGIC
 	res=f_open(&pageindex,"pages.idx",FA_CREATE_ALWAYS|FA_WRITE);
 	if (res)
 	{
@@ -120,6 +126,12 @@ void SDCreateLists(int mag, unsigned int pagecount)
 		put_rc(res);
 		return;
 	}
+	seekptr=PAGEINDEXMAGIC;
+	size=0;
+	hash=PAGEINDEXVERSION;
+	f_write(&pageindex,&seekptr,4,&charcount);
+	f_write(&pageindex,&size,2,&charcount);
+	f_write(&pageindex,&hash,4,&charcount);
 	
 	for(;;) {
 		res = f_readdir(&dir, &Finfo);
@@ -152,22 +164,36 @@ void SDCreateLists(int mag, unsigned int pagecount)
 			xprintf(PSTR("Parsed page M=%d, P=%02X, S=%02X : %s\n"),pageptr->mag,pageptr->page,pageptr->subpage,Finfo.fname);
 			if (page.mag==mag || 1) // Put all the pages in the list for now
 			{
-				// Write to the index file (plain text version)
-				sprintf(str,"%s,%lx,%x\n",Finfo.fname,pagesfile.fptr,page.filesize);
-				res=f_puts(str,&myfile);				
-				// Write to the index file (binary version)
-				f_write(&pageindex,&(pagesfile.fptr),4,&charcount);	// 4 byte seek pointer
-				f_write(&pageindex,&(page.filesize),2,&charcount);	// 2 byte file size 
-				// res=f_puts(Finfo.fname,&myfile);
-				// f_putc((int)'\n',&myfile);
 				// Copy to the pages file. (just a big file of ALL the pages)
+				// The FL line is held back so that the pre-encoded FX line can go in front of it
+				seekptr=pagesfile.fptr;
+				hash=PAGEHASHSTART;
+				FastextBegin();
 				f_open(&currentpage,Finfo.fname,FA_READ);
 				while (!f_eof(&currentpage))
 				{
 					ptr=f_gets(str,80,&currentpage);
-					f_puts(str,&pagesfile);
+					if (!FastextLine(str))
+					{
+						f_puts(str,&pagesfile);
+						hash=PageHash(hash,str,strlen(str));
+					}
 				}
 				f_close(&currentpage);
+				FastextEnd(str,page.mag);
+				f_puts(str,&pagesfile);
+				hash=PageHash(hash,str,strlen(str));
+				// The page is not the same size as the tti file any more
+				page.filesize=pagesfile.fptr-seekptr;
+				// Write to the index file (plain text version)
+				sprintf(str,"%s,%lx,%x\n",Finfo.fname,seekptr,page.filesize);
+				res=f_puts(str,&myfile);				
+				// Write to the index file (binary version)
+				f_write(&pageindex,&seekptr,4,&charcount);	// 4 byte seek pointer
+				f_write(&pageindex,&(page.filesize),2,&charcount);	// 2 byte file size 
+				f_write(&pageindex,&hash,4,&charcount);	// 4 byte content hash
+				// res=f_puts(Finfo.fname,&myfile);
+				// f_putc((int)'\n',&myfile);
 			}
 		}
 	}
@@ -0,0 +1,152 @@
+/*****************************************************************************
+ * Description       : Page upload staging for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file stage.c
+ * Page upload staging in the serial RAM
+ */
+
+#include "stage.h"
+
+static uint16_t stageLength;
+
+void StageClear(void)
+{
+	stageLength=0;
+} // StageClear
+
+uint16_t StageLength(void)
+{
+	return stageLength;
+} // StageLength
+
+uint8_t StageWrite(const char *data, uint16_t len)
+{
+	uint16_t n;
+	uint16_t start=stageLength;
+	if (len>STAGESIZE-stageLength)
+		return 1;
+	while (len)
+	{
+		n=len>STAGECHUNK?STAGECHUNK:len;
+		if (TaskWaitFIFO())	// The DENC only has it for a couple of ms
+		{
+			stageLength=start;
+			return 1;
+		}
+		PORTC.OUT&=~VBIT_SEL; // Set the mux to MPU so that we are in control
+		SetSerialRamAddress(SPIRAM_WRITE, STAGEBASE+stageLength);
+		WriteSerialRam((char*)data,n);
+		DeselectSerialRam();
+		data+=n;
+		len-=n;
+		stageLength+=n;
+	}
+	return 0;
+} // StageWrite
+
+uint8_t StageRead(uint16_t offset, char *data, uint16_t len)
+{
+	uint16_t n;
+	while (len)
+	{
+		n=len>STAGECHUNK?STAGECHUNK:len;
+		if (TaskWaitFIFO())
+			return 1;
+		PORTC.OUT&=~VBIT_SEL;
+		SetSerialRamAddress(SPIRAM_READ, STAGEBASE+offset);
+		ReadSerialRam(data,n);
+		DeselectSerialRam();
+		data+=n;
+		len-=n;
+		offset+=n;
+	}
+	return 0;
+} // StageRead
+
+uint8_t StageHash(uint16_t offset, uint16_t len, uint32_t *hash)
+{
+	char buf[STAGECHUNK];
+	uint16_t n;
+	*hash=PAGEHASHSTART;
+	while (len)
+	{
+		n=len>STAGECHUNK?STAGECHUNK:len;
+		if (StageRead(offset,buf,n))
+			return 1;
+		*hash=PageHash(*hash,buf,n);
+		offset+=n;
+		len-=n;
+	}
+	return 0;
+} // StageHash
+
+uint8_t StageCommit(uint16_t offset, uint16_t len, uint8_t mag, uint8_t page, uint16_t *ix)
+{
+	char buf[STAGECHUNK];
+	uint32_t seekptr;
+	uint32_t hash;
+	uint32_t oldhash;
+	uint16_t size;
+	uint16_t n;
+	NODEPTR np;
+	DISPLAYNODE node;
+	// Is it the same as what is on air? The scheduler sends everything again on a resync.
+	if (StageHash(offset,len,&hash))
+		return 1;
+	np=FindPage(mag,page);
+	if (np!=NULLPTR)
+	{
+		GetNode(&node,np);
+		if (!PageStoreGetIndex(node.pageindex,&seekptr,&size) && size==len &&
+			!PageStoreGetHash(node.pageindex,&oldhash) && oldhash==hash)
+		{
+			*ix=node.pageindex;
+			return STAGEUNCHANGED;
+		}
+	}
+	// FatFs gathers the chunks up into sectors
+	PageStoreAppendBegin(&seekptr);
+	while (len)
+	{
+		n=len>STAGECHUNK?STAGECHUNK:len;
+		if (StageRead(offset,buf,n))
+		{
+			PageStoreAppendFail();	// So that PageStoreAppendEnd doesn't index half a page
+			break;
+		}
+		if (PageStoreAppendData(buf,n))
+			break;
+		offset+=n;
+		len-=n;
+	}
+	return PageStoreAppendEnd(hash,ix);
+} // StageCommit
@@ -0,0 +1,94 @@
+/*****************************************************************************
+ * Description       : Page upload staging for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Page upload staging.
+ * Uploaded pages are held in the serial RAM (STAGEBASE, see vbi.h) until they are whole
+ * and have parsed. Then StageCommit adds each page to the page store with one append to
+ * pages.all and one record in pages.idx. A page that never gets finished never gets near
+ * the card. Nor does a page that is exactly the same as the one already on air.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \brief Page upload staging in the serial RAM
+*/
+#ifndef _STAGE_H_
+#define _STAGE_H_
+
+#include "avr_compiler.h"
+#include "vbit.h"
+
+// Bytes copied at a time. Small enough to finish before the DENC takes the RAM.
+#define STAGECHUNK	64
+
+/** Throw away whatever is staged
+ */
+void StageClear(void);
+
+/** \return The number of bytes staged
+ */
+uint16_t StageLength(void);
+
+/** Add to the end of the staging area
+ * \param data : Bytes to add
+ * \param len : Number of bytes
+ * \return 0 if OK, 1 if it doesn't fit or the FIFO stays busy (nothing is added)
+ */
+uint8_t StageWrite(const char *data, uint16_t len);
+
+/** Copy bytes back out of the staging area
+ * \param offset : From the start of the staging area
+ * \param data : Where to put them
+ * \param len : Number of bytes
+ * \return 0 if OK, 1 if the FIFO stays busy
+ */
+uint8_t StageRead(uint16_t offset, char *data, uint16_t len);
+
+// StageCommit didn't need to write anything
+#define STAGEUNCHANGED	0xff
+
+/** PageHash some staged bytes
+ * \param hash : Returns the hash
+ * \return 0 if OK, 1 if the FIFO stays busy
+ */
+uint8_t StageHash(uint16_t offset, uint16_t len, uint32_t *hash);
+
+/** Add staged bytes to the page store as one page, in one go.
+ * The on air files stay open. If it fails, nothing is left behind.
+ * If the page on air with the same number has the same size and hash, nothing is written.
+ * \param offset : Start of the page in the staging area
+ * \param len : Length of the page
+ * \param mag : Magazine 1..8
+ * \param page : Page number
+ * \param ix : Returns the record number of the page in pages.idx
+ * \return 0 if OK, STAGEUNCHANGED if the page is already on air, other values if failed
+ */
+uint8_t StageCommit(uint16_t offset, uint16_t len, uint8_t mag, uint8_t page, uint16_t *ix);
+
+#endif
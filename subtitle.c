@@ -0,0 +1,188 @@
+/*****************************************************************************
+ * Description       : Newfor subtitles for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Subtitles arrive over the command interface as S commands.
+ * A subtitle is built up a row at a time and then revealed.
+ * When revealed it is loaded into the priority lane, a pair of FIFO blocks
+ * that the FIFO switch sends ahead of the 20 field lookahead.
+ *
+ * SP<mpp>       - Set the subtitle page. Default 888.
+ * SB            - Begin a new subtitle (Newfor build). Throws away any rows.
+ * SL<row>,<text> - Add a row. Control codes have bit 7 set, as OL lines.
+ * SR            - Reveal the subtitle (Newfor display)
+ * SC            - Clear the screen
+ *
+ * The lane header ends any page that was open in the same magazine
+ * so the second lane block starts that page again with C9 set.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file subtitle.c
+ * Newfor subtitles
+ */
+
+#include "subtitle.h"
+
+#define SUBTITLE_NONE	0
+#define SUBTITLE_REVEAL	1
+#define SUBTITLE_CLEAR	2
+
+static uint8_t subtitleMag=8;
+static uint8_t subtitlePage=0x88;
+static char subtitleText[SUBTITLEMAXROWS][40];
+static uint8_t subtitleRow[SUBTITLEMAXROWS];	// Row number of each line of text
+static uint8_t subtitleRows;	// How many rows are in use
+static volatile uint8_t subtitlePending=SUBTITLE_NONE;
+
+uint8_t SubtitleCommand(char *cmd)
+{
+	char *ptr;
+	long n;
+	uint8_t row;
+	uint8_t i;
+	// Until SubtitleService has taken the last one we can't touch anything
+	if (subtitlePending!=SUBTITLE_NONE)
+		return 1;
+	switch (cmd[1])
+	{
+	case 'P': // SP<mpp>
+		cmd[0]='0';cmd[1]='x';
+		ptr=cmd;
+		xatoi(&ptr,&n);
+		if (n<0x100 || n>0x8ff)
+			return 1;
+		subtitleMag=n/0x100;
+		subtitlePage=n%0x100;
+		break;
+	case 'B': // SB
+		subtitleRows=0;
+		break;
+	case 'L': // SL<row>,<text>
+		ptr=&cmd[2];
+		row=atoi(ptr);
+		if (row<1 || row>23 || subtitleRows>=SUBTITLEMAXROWS)
+			return 1;
+		while (isdigit(*ptr)) ptr++;
+		if (*ptr==',')
+			ptr++;
+		// MRG line format is bit 8 set if it is a control code < ' '
+		for (i=0;i<40;i++)
+		{
+			if (*ptr && *ptr!='\r' && *ptr!='\n')
+				subtitleText[subtitleRows][i]=*ptr++ & 0x7f;
+			else
+				subtitleText[subtitleRows][i]=' ';
+		}
+		subtitleRow[subtitleRows++]=row;
+		break;
+	case 'R': // SR
+		subtitlePending=SUBTITLE_REVEAL;
+		break;
+	case 'C': // SC
+		subtitlePending=SUBTITLE_CLEAR;
+		break;
+	default:
+		return 1;
+	}
+	return 0;
+} // SubtitleCommand
+
+/** Write a packet into the lane
+ * \param parity : Which lane block 0..1
+ * \param line : Line number in the block
+ * \return 0 if OK, 1 if the FIFO has been taken away
+ */
+static uint8_t WriteLane(uint8_t parity, uint8_t line, char *packet)
+{
+	if (FIFOBusy)
+		return 1;
+	SetSerialRamAddress(SPIRAM_WRITE, LANEBASE+parity*FIFOBLOCKSIZE+line*PACKETSIZE);
+	WriteSerialRam(packet, PACKETSIZE);
+	return 0;
+} // WriteLane
+
+void SubtitleService(void)
+{
+	char packet[PACKETSIZE];
+	OPENPAGE open;
+	uint8_t first;	// Parity of the lane block that goes out first
+	uint8_t line;
+	uint8_t i;
+	if (subtitlePending==SUBTITLE_NONE || laneState!=LANE_IDLE || FIFOBusy)
+		return;
+	PORTC.OUT&=~VBIT_SEL; // Set the mux to MPU so that we are in control
+	// fifoReadIndex is the next block to go out. The lane goes in front of it
+	first=fifoReadIndex%2;
+	// First block: the subtitle itself
+	Header(packet,subtitleMag,subtitlePage,0,CTRL_C4_ERASEBIT_bm|CTRL_C6_SUBTITLE_bm,g_Header);
+	if (WriteLane(first,0,packet))
+		return;
+	line=1;
+	if (subtitlePending==SUBTITLE_REVEAL)
+	{
+		for (i=0;i<subtitleRows;i++)
+		{
+			WritePrefix(packet,subtitleMag,subtitleRow[i]);
+			memcpy(&packet[5],subtitleText[i],40);
+			Parity(packet,5);
+			if (WriteLane(first,line++,packet))
+				return;
+		}
+	}
+	QuietLine(packet,0x0e|first);
+	for (;line<VBILINES+first;line++)
+		if (WriteLane(first,line,packet))
+			return;
+	// Second block: restart the page that we cut into.
+	// In parallel mode only our magazine is cut. In serial mode every magazine is.
+	GetOpenPage(fifoReadIndex,&open);
+	line=0;
+	if (open.mag && (open.mag%8==subtitleMag%8 || (open.control & CTRL_C11_MAGAZINESERIAL_bm)))
+	{
+		Header(packet,open.mag,open.page,open.subcode,
+			(open.control & ~CTRL_C4_ERASEBIT_bm)|CTRL_C9_INTERRUPTEDSEQUENCE_bm,g_Header);
+		if (WriteLane(first^1,line++,packet))
+			return;
+	}
+	QuietLine(packet,0x0e|(first^1));
+	for (;line<VBILINES+(first^1);line++)
+		if (WriteLane(first^1,line,packet))
+			return;
+	// Hand it over. The first block must go out on the field that block fifoReadIndex would have used
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (!FIFOBusy)
+		{
+			laneField=first^1;
+			laneState=LANE_FIRST;
+			subtitlePending=SUBTITLE_NONE;
+		}
+	}
+} // SubtitleService
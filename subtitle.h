@@ -0,0 +1,70 @@
+/*****************************************************************************
+ * Description       : Newfor subtitles for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Subtitles arrive over the command interface as S commands.
+ * A subtitle is built up a row at a time and then revealed.
+ * When revealed it is loaded into the priority lane, a pair of FIFO blocks
+ * that the FIFO switch sends ahead of the 20 field lookahead.
+ *
+ * SP<mpp>       - Set the subtitle page. Default 888.
+ * SB            - Begin a new subtitle (Newfor build). Throws away any rows.
+ * SL<row>,<text> - Add a row. Control codes have bit 7 set, as OL lines.
+ * SR            - Reveal the subtitle (Newfor display)
+ * SC            - Clear the screen
+ *
+ * The lane header ends any page that was open in the same magazine
+ * so the second lane block starts that page again with C9 set.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \brief Newfor subtitle insertion
+*/
+#ifndef _SUBTITLE_H_
+#define _SUBTITLE_H_
+
+#include "avr_compiler.h"
+#include <avr/pgmspace.h>
+#include "xitoa.h"
+#include "vbit.h"
+
+/// Most rows that a subtitle can have. Newfor allows more but nobody reads more than this.
+#define SUBTITLEMAXROWS 4
+
+/** Handle an S command
+ * \param cmd : The command line, starting with the S
+ * \return 0 if OK, 1 if the command was bad or the last subtitle has not gone yet
+ */
+uint8_t SubtitleCommand(char *cmd);
+
+/** Load a revealed subtitle into the lane. FillFIFO calls this every time it runs.
+ */
+void SubtitleService(void);
+
+#endif
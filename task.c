@@ -0,0 +1,122 @@
+/*****************************************************************************
+ * Description       : Cooperative main loop for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file task.c
+ * Cooperative main loop
+ */
+
+#include "task.h"
+
+static TC0_t *timerTask = &TCF0;
+static JOBSTEP job[TASKJOBS];
+
+void TaskInit(void)
+{
+	timerTask->PER=0xffff;
+	timerTask->CTRLA = ( timerTask->CTRLA & ~TC0_CLKSEL_gm ) | TC_CLKSEL_DIV1024_gc;
+} // TaskInit
+
+uint16_t TaskTime(void)
+{
+	uint16_t t;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		t=timerTask->CNT;	// 16 bit register. Reading it uses the TEMP register.
+	}
+	return t;
+} // TaskTime
+
+uint8_t TaskExpired(uint16_t start, uint16_t budget)
+{
+	return (uint16_t)(TaskTime()-start)>=budget;
+} // TaskExpired
+
+void TaskYield(void)
+{
+	if (vbiDone) // do the next field?
+	{
+		FillFIFO();
+		vbiDone=0; // Reset the flag
+	}
+	DeferService();	// Per field and per second jobs
+} // TaskYield
+
+uint8_t TaskWaitFIFO(void)
+{
+	uint16_t start=TaskTime();
+	while (FIFOBusy)
+		if (TaskExpired(start,TASKFIFOTIMEOUT))
+			return 1;
+	return 0;
+} // TaskWaitFIFO
+
+uint8_t TaskAddJob(JOBSTEP step)
+{
+	uint8_t i;
+	uint8_t free=TASKJOBS;
+	for (i=0;i<TASKJOBS;i++)
+	{
+		if (job[i]==step)
+			return 0;	// Already waiting
+		if (!job[i] && free==TASKJOBS)
+			free=i;
+	}
+	if (free>=TASKJOBS)
+		return 1;
+	job[free]=step;
+	return 0;
+} // TaskAddJob
+
+void TaskRunJobs(void)
+{
+	static uint8_t next;	// Take turns
+	uint16_t start=TaskTime();
+	uint8_t i;
+	uint8_t result;
+	for (i=0;i<TASKJOBS && !TaskExpired(start,TASKJOBBUDGET);i++)
+	{
+		next=(next+1)%TASKJOBS;
+		if (!job[next])
+			continue;
+		while (!TaskExpired(start,TASKJOBBUDGET))
+		{
+			result=job[next]();
+			if (!result)
+			{
+				job[next]=0;	// Finished
+				break;
+			}
+			if (result==TASKWAIT)
+				break;		// Don't spin on it. Give the budget to the other jobs.
+		}
+	}
+} // TaskRunJobs
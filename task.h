@@ -0,0 +1,106 @@
+/*****************************************************************************
+ * Description       : Cooperative main loop for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * The main loop. Everything is run to completion, in order of priority:
+ * 1) Filling the FIFO, as soon as the vbi is over (vbiDone).
+ * 2) Deferred per field and per second work. See defer.c
+ * 3) Command characters from the host, which are put together into lines without waiting.
+ * 4) A command, once it has a whole line.
+ * 5) Background jobs, one step at a time, until the time budget runs out.
+ * A command or job that can take a long time must call TaskYield every so often
+ * (eg. once per line of a file) so that 1 and 2 still get done on time.
+ * TaskYield doesn't run commands or jobs, so nothing that a command is in the
+ * middle of gets changed underneath it.
+ * Time is measured with TCF0 running freely at F_CPU/1024.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \brief Cooperative main loop
+*/
+#ifndef _TASK_H_
+#define _TASK_H_
+
+#include "avr_compiler.h"
+#include "vbit.h"
+
+#define TASKTICKSPERMS	(F_CPU/1024/1000)
+// How long background jobs get each time round the main loop
+#define TASKJOBBUDGET	(2*TASKTICKSPERMS)
+// Longest that TaskWaitFIFO waits. FIFOBusy is normally clear within a field.
+#define TASKFIFOTIMEOUT	(50*TASKTICKSPERMS)
+// How many background jobs can be waiting
+#define TASKJOBS		4
+
+// A job step returns TASKWAIT when it can't do anything until something else happens
+#define TASKWAIT		2
+
+/** A step of a background job. Do a little bit of work.
+ * \return 0 if the job is finished, 1 if there is more to do,
+ * TASKWAIT if it is waiting. It isn't called again until the next time round the main loop.
+ */
+typedef uint8_t (*JOBSTEP)(void);
+
+/** Start the task timer
+ */
+void TaskInit(void);
+
+/** \return The task timer. It wraps round every 65536 ticks.
+ */
+uint16_t TaskTime(void);
+
+/** \param start : TaskTime when the work started
+ * \param budget : Ticks allowed
+ * \return 1 if the budget has been used up
+ */
+uint8_t TaskExpired(uint16_t start, uint16_t budget);
+
+/** Do the on-air work (FIFO and deferred work) if there is any.
+ * Long commands and jobs call this every so often.
+ */
+void TaskYield(void);
+
+/** Wait for the DENC to finish with the serial RAM (FIFOBusy).
+ * It only has it for a couple of ms each field, and FillFIFO can't do anything until
+ * then either, so this doesn't yield. That makes it safe during a page store append.
+ * Don't call it from DeferService or a job.
+ * \return 0 if the RAM is free, 1 if it timed out (has the video stopped?)
+ */
+uint8_t TaskWaitFIFO(void);
+
+/** Add a background job. Adding a job that is already waiting does nothing.
+ * \return 0 if OK, 1 if there is no room
+ */
+uint8_t TaskAddJob(JOBSTEP job);
+
+/** Run background job steps until the budget runs out or there is nothing to do
+ */
+void TaskRunJobs(void);
+
+#endif
@@ -0,0 +1,169 @@
+/*****************************************************************************
+ * Description       : Host test for the memory mapped page store
+ * Compiler          : GCC (WinAVR)
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file pagestore_test.c
+ * Host test for pagestore_mmap.c. Run with make hosttest
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../pagestore.h"
+
+static int failures;
+
+#define CHECK(x) do { if (!(x)) { printf("%s:%d: CHECK(%s) failed\n",__FILE__,__LINE__,#x); failures++; } } while (0)
+
+static const char page1[]="PN,10000\nPS,8000\nOL,1,Page one\n";
+static const char page2[]="PN,20100\nPS,8000\nOL,1,Page two row 1\nOL,2,Page two row 2\n";
+
+/** Make an empty page store in a new folder and go into it
+ */
+static void MakeStore(void)
+{
+	char dir[]="/tmp/pagestoreXXXXXX";
+	FILE *f;
+	if (!mkdtemp(dir) || chdir(dir))
+	{
+		perror("pagestore_test");
+		exit(1);
+	}
+	f=fopen("pages.all","w");
+	fclose(f);
+	f=fopen("pages.idx","w");
+	fclose(f);
+} // MakeStore
+
+/** Write pages.idx with just the header record, as the C command does
+ */
+static void WriteIndexHeader(void)
+{
+	static const uint8_t rec[PAGEINDEXRECORDSIZE]={
+		PAGEINDEXMAGIC&0xff,(PAGEINDEXMAGIC>>8)&0xff,(PAGEINDEXMAGIC>>16)&0xff,PAGEINDEXMAGIC>>24,
+		0,0,
+		PAGEINDEXVERSION,0,0,0};
+	FILE *f=fopen("pages.idx","wb");
+	fwrite(rec,1,sizeof(rec),f);
+	fclose(f);
+} // WriteIndexHeader
+
+static uint16_t AddPage(const char *data, uint32_t hash)
+{
+	uint32_t seekptr;
+	uint16_t ix=0xffff;
+	CHECK(PageStoreAppendBegin(&seekptr)==0);
+	CHECK(PageStoreAppendData(data,strlen(data))==0);
+	CHECK(PageStoreAppendEnd(hash,&ix)==0);
+	return ix;
+} // AddPage
+
+/** Read the page at ix line by line and compare it with data
+ */
+static void CheckPage(uint16_t ix, const char *data, uint32_t hash)
+{
+	uint32_t seekptr,h;
+	uint16_t pagesize;
+	char buf[80];
+	char *line;
+	uint8_t count;
+	size_t done=0;
+	CHECK(PageStoreGetIndex(ix,&seekptr,&pagesize)==0);
+	CHECK(pagesize==strlen(data));
+	CHECK(PageStoreGetHash(ix,&h)==0 && h==hash);
+	CHECK(PageStoreSeek(seekptr)==0);
+	while (done<pagesize)
+	{
+		line=PageStoreGetLine(buf,sizeof(buf),&count);
+		CHECK(line!=0 && count>0);
+		if (!line || !count)
+			return;
+		CHECK(line!=buf);	// Straight out of the mapping
+		CHECK(memcmp(line,data+done,count)==0);
+		CHECK(line[count-1]=='\n');
+		done+=count;
+	}
+	CHECK(PageStoreTell()==seekptr+pagesize);
+} // CheckPage
+
+int main(void)
+{
+	uint32_t seekptr;
+	uint16_t pagesize;
+	uint16_t ix1,ix2,ix3;
+	struct stat st;
+	uint8_t count;
+	char buf[80];
+	MakeStore();
+	// An index without the header is in the old format. It mustn't be used.
+	CHECK(PageStoreOpen()!=0);
+	CHECK(!PageStoreIsOpen());
+	WriteIndexHeader();
+	CHECK(PageStoreOpen()==0);
+	CHECK(PageStoreIsOpen());
+	CHECK(PageStoreGetIndex(0,&seekptr,&pagesize)==0 && seekptr==PAGEINDEXMAGIC && pagesize==0);
+	CHECK(PageStoreGetIndex(1,&seekptr,&pagesize)!=0);	// No pages yet
+	ix1=AddPage(page1,0x11111111UL);
+	CHECK(ix1==1);	// Pages start after the header
+	CheckPage(ix1,page1,0x11111111UL);
+	// The transmission side is part way through page 1 when page 2 arrives
+	CHECK(PageStoreGetIndex(ix1,&seekptr,&pagesize)==0);
+	CHECK(PageStoreSeek(seekptr)==0);
+	CHECK(PageStoreGetLine(buf,sizeof(buf),&count)!=0);
+	ix2=AddPage(page2,0x22222222UL);
+	CHECK(ix2==ix1+1);
+	CHECK(PageStoreTell()==seekptr+count);	// Remapping didn't move it
+	CheckPage(ix2,page2,0x22222222UL);
+	CheckPage(ix1,page1,0x11111111UL);
+	// A page that is given up on leaves nothing behind
+	CHECK(PageStoreAppendBegin(&seekptr)==0);
+	CHECK(PageStoreAppendData(page1,strlen(page1))==0);
+	PageStoreAppendFail();
+	CHECK(PageStoreAppendEnd(0x33333333UL,&ix3)!=0);
+	CHECK(PageStoreGetIndex(ix2+1,&seekptr,&pagesize)!=0);
+	CHECK(PageStoreGetIndex(ix2,&seekptr,&pagesize)==0);
+	CHECK(stat("pages.all",&st)==0 && st.st_size==seekptr+pagesize);
+	// Dropping a page zeroes its size and leaves the others alone
+	CHECK(PageStoreDropIndex(ix1)==0);
+	CHECK(PageStoreGetIndex(ix1,&seekptr,&pagesize)==0 && pagesize==0);
+	CheckPage(ix2,page2,0x22222222UL);
+	PageStoreClose();
+	CHECK(!PageStoreIsOpen());
+	if (failures)
+	{
+		printf("pagestore_test: %d failures\n",failures);
+		return 1;
+	}
+	printf("pagestore_test: OK\n");
+	return 0;
+} // main
@@ -0,0 +1,153 @@
+/*****************************************************************************
+ * Description       : Host stress test for the lock free rings
+ * Compiler          : GCC (WinAVR)
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file ring_test.c
+ * Host stress test for ring.c. A producer thread and a consumer thread push a
+ * counting sequence through a small ring with varying bulk sizes, and the consumer
+ * checks that every byte comes out once and in order. Run with make hosttest
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "../ring.h"
+
+#define RINGSIZE 16
+#define TOTAL 10000000UL
+
+static RING ring;
+static uint8_t ringbuf[RINGSIZE];
+static unsigned long failures;
+
+/** Cheap pseudo random bulk size, 1..RINGSIZE+3 so some calls ask for more than fits
+ */
+static uint8_t NextLen(uint32_t *seed)
+{
+	*seed=*seed*1103515245UL+12345UL;
+	return (uint8_t)(1+(*seed>>16)%(RINGSIZE+3));
+} // NextLen
+
+static void *Producer(void *arg)
+{
+	uint32_t seed=1;
+	uint8_t data[RINGSIZE+3];
+	uint8_t len,i,n;
+	unsigned long sent=0;
+	uint8_t next=0;
+	(void)arg;
+	while (sent<TOTAL)
+	{
+		len=NextLen(&seed);
+		if (len>TOTAL-sent)
+			len=(uint8_t)(TOTAL-sent);
+		for (i=0;i<len;i++)
+			data[i]=(uint8_t)(next+i);
+		if (len==1)
+			n=RingPut(&ring,data[0])?0:1;
+		else
+			n=RingPutBulk(&ring,data,len);
+		if (n>RINGSIZE)
+			failures++;
+		if (!n)
+			sched_yield();	// Full. Let the consumer run if there is only one core
+		next+=n;
+		sent+=n;
+	}
+	return NULL;
+} // Producer
+
+static void *Consumer(void *arg)
+{
+	uint32_t seed=2;
+	uint8_t data[RINGSIZE+3];
+	uint8_t peek[RINGSIZE+3];
+	uint8_t len,i,n,p;
+	unsigned long got=0;
+	uint8_t expect=0;
+	(void)arg;
+	while (got<TOTAL)
+	{
+		len=NextLen(&seed);
+		if (len&1)
+		{
+			// Peek first. It must agree with what the get returns
+			p=RingPeek(&ring,peek,len);
+			n=RingGetBulk(&ring,data,len);
+			if (n<p)
+				failures++;
+			for (i=0;i<p && i<n;i++)
+				if (peek[i]!=data[i])
+					failures++;
+		}
+		else if (len==2)
+			n=RingGet(&ring,data)?0:1;
+		else
+			n=RingGetBulk(&ring,data,len);
+		if (n>len)
+			failures++;
+		for (i=0;i<n;i++,expect++)
+			if (data[i]!=expect)
+			{
+				if (failures<10)
+					printf("ring_test: byte %lu is %d, expected %d\n",got+i,data[i],expect);
+				failures++;
+				expect=data[i];
+			}
+		if (!n)
+			sched_yield();
+		got+=n;
+	}
+	return NULL;
+} // Consumer
+
+int main(void)
+{
+	pthread_t prod,cons;
+	RingInit(&ring,ringbuf,RINGSIZE);
+	if (pthread_create(&cons,NULL,Consumer,NULL) || pthread_create(&prod,NULL,Producer,NULL))
+	{
+		perror("ring_test");
+		return 1;
+	}
+	pthread_join(prod,NULL);
+	pthread_join(cons,NULL);
+	if (RingCount(&ring)!=0)
+		failures++;
+	if (failures)
+	{
+		printf("ring_test: %lu failures\n",failures);
+		return 1;
+	}
+	printf("ring_test: OK\n");
+	return 0;
+} // main
@@ -0,0 +1,284 @@
+/*****************************************************************************
+ * Description       : Binary page upload for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \file upload.c
+ * Framed binary page upload
+ */
+
+#include <util/crc16.h>
+#include "upload.h"
+
+typedef enum {UP_IDLE, UP_STX, UP_SEQ, UP_LENLO, UP_LENHI, UP_DATA, UP_CRCHI, UP_CRCLO} UPLOADSTATE;
+
+/** A page in the staging area. It goes to the page store when its frame is good.
+ */
+typedef struct
+{
+	uint16_t offset;
+	uint16_t size;
+	PAGEMETA meta;		// Header details for the display list
+	uint8_t subcode;
+} UPLOADPAGE;
+
+static uint8_t state=UP_IDLE;
+static uint16_t lastTime;		// TaskTime when the last character came in
+
+// The frame coming in
+static uint8_t seq;
+static uint16_t length;
+static uint16_t count;
+static uint16_t crc;
+static uint16_t rxcrc;
+static uint8_t writing;			// 1 if this is the frame we want
+static uint8_t frameError;
+
+static uint8_t expected;		// seq of the next frame we want
+static uint8_t nakSent;			// Only one N until the frame we want turns up
+
+// The page coming in
+static PAGE page;
+static uint8_t inPage;
+static uint16_t pageStart;		// Offset in the staging area
+static PAGEMETA pageMeta;		// The header, as it was at the first OL line
+static char line[UPLOADLINESIZE];
+static uint8_t lineLen;
+
+static UPLOADPAGE pages[UPLOADPAGES];	// Pages in this frame
+static uint8_t pageCount;
+
+uint8_t UploadStart(void)
+{
+	if (state!=UP_IDLE)
+		return 1;
+	expected=0;
+	nakSent=0;
+	lastTime=TaskTime();
+	state=UP_STX;
+	return 0;
+} // UploadStart
+
+uint8_t UploadActive(void)
+{
+	return state!=UP_IDLE;
+} // UploadActive
+
+/** Leave binary mode
+ */
+static void UploadStop(void)
+{
+	StageClear();
+	state=UP_IDLE;
+} // UploadStop
+
+static void Nak(void)
+{
+	if (nakSent)
+		return;
+	nakSent=1;
+	xprintf(PSTR("N%02X\r"),expected);
+} // Nak
+
+static void EndPage(void)
+{
+	UPLOADPAGE *p;
+	char fastext[FASTEXTENDSIZE];
+	inPage=0;
+	FastextEnd(fastext,page.mag);	// Pre-encoded X/27/0 and the FL line
+	if (pageCount>=UPLOADPAGES || StageWrite(fastext,strlen(fastext)))
+	{
+		frameError=1;
+		return;
+	}
+	p=&pages[pageCount++];
+	p->offset=pageStart;
+	p->size=StageLength()-pageStart;
+	if (!pageMeta.body)
+		MakePageMeta(&pageMeta,&page,0);	// No rows. At least get the page number.
+	p->meta=pageMeta;
+	p->subcode=page.subcode;
+} // EndPage
+
+/** Deal with a whole line from the payload, without its \n
+ */
+static void UploadLine(void)
+{
+	if (!lineLen || (lineLen==1 && line[0]=='\r'))
+	{
+		if (inPage)
+			EndPage();
+		return;	// Extra blank lines between pages don't matter
+	}
+	line[lineLen]=0;
+	if (!inPage)
+	{
+		inPage=1;
+		ClearPage(&page);
+		FastextBegin();
+		pageStart=StageLength();
+		pageMeta.body=0;
+	}
+	if (!FastextLine(line))	// FL goes after FX, at the end of the page
+	{
+		if (!pageMeta.body && line[0]=='O' && line[1]=='L')
+			MakePageMeta(&pageMeta,&page,StageLength()-pageStart);	// Where insert will find the rows
+		line[lineLen]='\n';
+		if (StageWrite(line,lineLen+1))
+			frameError=1;	// Too big
+		line[lineLen]=0;
+	}
+	// Stage first, ParseLine changes the line
+	if (ParseLine(&page,line))
+		frameError=1;
+} // UploadLine
+
+/** The CRC has arrived. Keep the frame or throw it away.
+ */
+static void EndFrame(void)
+{
+	uint8_t i;
+	uint8_t res;
+	uint16_t ix;
+	if (!writing)
+	{
+		// If we already have it then the A went missing
+		if (crc==rxcrc && (uint8_t)(expected-seq-1)<UPLOADWINDOW)
+			xprintf(PSTR("A%02X\r"),(uint8_t)(expected-1));
+		else
+			Nak();
+		return;
+	}
+	nakSent=0;	// This is the frame we asked for, so it gets an answer either way
+	if (frameError || inPage || crc!=rxcrc)
+	{
+		Nak();	// Nothing has gone to the card
+		return;
+	}
+	// The frame is good. Each page goes to the card in one go, then on air.
+	for (i=0;i<pageCount;i++)
+	{
+		res=StageCommit(pages[i].offset,pages[i].size,pages[i].meta.mag,pages[i].meta.page,&ix);
+		if (res==STAGEUNCHANGED)
+			continue;	// Already on air
+		if (res)
+		{
+			xprintf(PSTR("Upload failed. Can not write the page store\n\r"));
+			UploadStop();
+			return;
+		}
+		LinkPage(pages[i].meta.mag,pages[i].meta.page,pages[i].subcode,ix);
+		SetPageMeta(&pages[i].meta);
+		UrgentPage(pages[i].meta.mag,pages[i].meta.page);
+		TaskYield();	// Keep the FIFO going
+	}
+	xprintf(PSTR("A%02X\r"),seq);
+	expected++;
+	if (!length)
+		UploadStop();	// That was the end frame
+} // EndFrame
+
+void UploadService(void)
+{
+	unsigned char c;
+	uint16_t start=TaskTime();
+	while (state!=UP_IDLE && !TaskExpired(start,TASKJOBBUDGET))
+	{
+		if (!USB_Serial_GetNB(&c))
+		{
+			if (TaskExpired(lastTime,UPLOADTIMEOUT))
+			{
+				xprintf(PSTR("Upload timed out\n\r"));
+				UploadStop();
+			}
+			return;
+		}
+		lastTime=TaskTime();
+		if (state>UP_STX && state<UP_CRCHI)
+			crc=_crc_xmodem_update(crc,c);
+		switch (state)
+		{
+		case UP_STX:
+			if (c==UPLOADSTX)	// Anything else between frames is ignored
+			{
+				crc=0;
+				state=UP_SEQ;
+			}
+			break;
+		case UP_SEQ:
+			seq=c;
+			state=UP_LENLO;
+			break;
+		case UP_LENLO:
+			length=c;
+			state=UP_LENHI;
+			break;
+		case UP_LENHI:
+			length|=(uint16_t)c<<8;
+			count=0;
+			writing=(seq==expected);
+			frameError=length>UPLOADMAXFRAME;
+			if (writing)
+				StageClear();
+			inPage=0;
+			lineLen=0;
+			pageCount=0;
+			state=length?UP_DATA:UP_CRCHI;
+			break;
+		case UP_DATA:
+			if (writing && !frameError)
+			{
+				if (c=='\n')
+				{
+					UploadLine();
+					lineLen=0;
+				}
+				else if (lineLen<UPLOADLINESIZE-1)
+					line[lineLen++]=c;
+				else
+					frameError=1;	// Line too long
+			}
+			if (++count==length)
+				state=UP_CRCHI;
+			break;
+		case UP_CRCHI:
+			rxcrc=(uint16_t)c<<8;
+			state=UP_CRCLO;
+			break;
+		case UP_CRCLO:
+			rxcrc|=c;
+			state=UP_STX;
+			EndFrame();
+			break;
+		default:
+			state=UP_IDLE;
+		}
+	}
+} // UploadService
@@ -0,0 +1,91 @@
+/*****************************************************************************
+ * Description       : Binary page upload for VBIT/XMEGA
+ * Compiler          : GCC (WinAVR)
+ *
+ * Binary page upload. ea/ee takes one command per line, each echoed and acknowledged.
+ * This takes frames of whole pages instead, and acknowledges them in the background.
+ *
+ * eb replies with the window, the most pages per frame and the longest payload,
+ * "0W4,P4,L20040" (the last 0 is the usual address).
+ * After that, until the end frame, everything from the host is frames:
+ * STX(0x02) seq lenlo lenhi <len bytes of payload> crchi crclo
+ * seq counts up from 0 and wraps. The CRC is CRC-16/XMODEM (poly 0x1021, start 0)
+ * over seq, the length and the payload.
+ * The payload is pages in tti format, exactly as they are to go into pages.all,
+ * lines ending in \n. An empty line (or just \r) ends a page.
+ * A frame must end on the end of a page.
+ * A frame with a length of 0 ends the upload.
+ *
+ * Replies, each ending in \r. Anything else is diagnostics and can be ignored.
+ * A<seq> : Every frame up to and including seq is on the card and the pages are on air.
+ * N<seq> : Frame seq was bad or missing. Send again from seq (go back N).
+ *          Frames after it are thrown away, and only one N is sent until seq turns up.
+ * The host may send up to the window of frames without waiting for an A.
+ * Flow control below that is done by the USB CDC link, which holds off the host
+ * while we are busy with the card.
+ *
+ * A frame is staged in the serial RAM (see stage.h) and nothing goes to the card
+ * until it is good. Then each page is added with one append to pages.all.
+ *
+ * Copyright (c) 2012 Peter Kwan
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The name(s) of the above copyright holders shall not be used in
+ * advertising or otherwise to promote the sale, use or other
+ * dealings in this Software without prior written authorization.
+ *
+ *****************************************************************************/ 
+ /** \brief Framed binary page upload
+*/
+#ifndef _UPLOAD_H_
+#define _UPLOAD_H_
+
+#include "vbit.h"
+
+// Unacknowledged frames that the host may have in flight
+#define UPLOADWINDOW	4
+// Most pages in one frame
+#define UPLOADPAGES		4
+// Longest payload. The frame is staged along with the FX and FL lines of each page.
+#define UPLOADMAXFRAME	(STAGESIZE-UPLOADPAGES*FASTEXTENDSIZE)
+// Longest tti line, including the \r
+#define UPLOADLINESIZE	100
+// Give up if the host goes quiet for this long (ticks, see task.h)
+#define UPLOADTIMEOUT	(2000*TASKTICKSPERMS)
+
+#define UPLOADSTX	0x02
+
+/** Start a binary upload (eb command)
+ * \return 0 if OK, >0 if failed
+ */
+uint8_t UploadStart(void);
+
+/** \return 1 if a binary upload is in progress. The main loop passes characters to UploadService instead of get_line.
+ */
+uint8_t UploadActive(void);
+
+/** Take whatever characters have arrived and deal with them. Doesn't wait.
+ */
+void UploadService(void);
+
+#endif
@@ -46,46 +46,67 @@
 /* hic sunt globals */
 volatile uint8_t vbiDone; // Set when the timer reckons that the vbi is over. Cleared by main.
 volatile uint32_t UTC=36000; // 10:00am
+volatile uint16_t MJD=55927; // 1 Jan 2012. Set with TD.
 volatile uint8_t FIFOBusy;	// When set, the FillFIFO process is required to release the FIFO.
 volatile uint8_t fifoReadIndex; /// maintains the tx block index 0..MAXFIFOINDEX-1
 volatile uint8_t fifoWriteIndex; /// maintains the load index 0..MAXFIFOINDEX-1
+volatile uint32_t FieldCount;	// Fields since we started. This is the time base.
+volatile uint8_t fifoDepth=MAXFIFOINDEX;	// Start deep. The SD card is busy at startup.
+uint8_t fifoDepthMin=FIFOMINDEPTH;
+uint8_t fifoDepthMax=MAXFIFOINDEX;
+uint16_t fifoUnderrunTotal;
+volatile uint8_t laneState=LANE_IDLE;
+uint8_t laneField;
+static volatile uint8_t fifoUnderruns;	// Set by the FIFO switch when there was no block ready
+static volatile uint32_t utcField; // The FieldCount when UTC last ticked
 
  /* Instantiate pointer to fieldPort. */
 static PORT_t *fieldPort = &PORTC;
 static TC0_t *timerVBIControl = &TCD0;
 static TC1_t *timerFIFOBusyControl = &TCE1;
-/*! Field interrupt
- * This maintains the real time clock. Sadly, if the video stops, the clock goes wrong
- * It also starts two timers that coordinate when the FIFO may be written to,.
+/** Maintain the UTC. Called from DeferService every second.
+ * Sadly, if the video stops, the clock goes wrong
  */
-void FieldInterruptHandler(void)
+static void ClockTick(uint32_t field)
 {
 	const uint32_t day=(uint32_t)60*60*24;
-	// LED_On( LED_3 ); // Got a field interrupt (video OK)
-	static int count=0;
-	//static int secs=0;
-	char str[20];
-	count++;
-	/*if ((count%50)==0)
-		xputs(PSTR("."));
-	*/
-	// Maintain the UTC.
-	if ((count%50)==0)
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
+		utcField=field;
 		UTC++;
 		if (UTC>=day)
+		{
 			UTC=0;
+			MJD++;
+		}
+	}
+} // ClockTick
+
 #define RUN_FADER
 #ifdef RUN_FADER
-		// SISCom databroadcast fader
-		// This is a periodic command sent exercise the SISCOM receiver
-		// Toggle the fade direction every 3 seconds
-		strcpy(str,"\016fade,0,1\n");
-		str[6]=((UTC/3)%2==0)?'1':'0';
-		putringstring(str);
-#endif	
-	}
+/** SISCom databroadcast fader
+ * This is a periodic command sent exercise the SISCOM receiver
+ * Toggle the fade direction every 3 seconds
+ */
+static void Fader(uint32_t field)
+{
+	char str[20];
+	strcpy(str,"\016fade,0,1\n");
+	str[6]=((UTC/3)%2==0)?'1':'0';
+	DataBroadcastPut(0,(uint8_t*)str,strlen(str));	// If the FIFO is busy it misses a go
+} // Fader
+#endif
+
+/*! Field interrupt
+ * This counts the fields and leaves the rest to DeferService.
+ * It also starts two timers that coordinate when the FIFO may be written to,.
+ */
+void FieldInterruptHandler(void)
+{
+	// LED_On( LED_3 ); // Got a field interrupt (video OK)
+	FieldCount++;
 	// What is the state of PINC.2
+	DeferField(FieldCount,PORTC.IN&VBIT_FLD?0:1);	// High on the even field
 
 	// Start the vbi timer
 	// We want a preset 15625 cycles at fosc/1 for 1024us
@@ -112,6 +133,112 @@ void FieldInterruptHandler(void)
 	PMIC.CTRL |= PMIC_LOLVLEN_bm;		
 } // FieldInterruptHandler
 
+/** Which field will the FIFO block that is being loaded go out on?
+ * The block at fifoReadIndex is on air now, so each block between the
+ * read and write indexes is one more field into the future.
+ * \return The projected FieldCount when block fifoWriteIndex is transmitted
+ */
+uint32_t AirField(void)
+{
+	uint32_t field;
+	uint8_t ahead;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		field=FieldCount;
+		ahead=(fifoWriteIndex+MAXFIFOINDEX-fifoReadIndex)%MAXFIFOINDEX;
+	}
+	return field+ahead;
+} // AirField
+
+/** Converts a field number into the time of day
+ * \param field : A FieldCount value. Usually from AirField.
+ * \return UTC in seconds at that field
+ */
+uint32_t FieldToUTC(uint32_t field)
+{
+	const uint32_t day=(uint32_t)60*60*24;
+	uint32_t utc;
+	uint32_t base;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		utc=UTC;
+		base=utcField;
+	}
+	utc+=(int32_t)(field-base)/50;	// Could be slightly in the past if the read index stalled
+	if ((int32_t)utc<0)
+		utc+=day;
+	return utc%day;
+} // FieldToUTC
+
+/** Converts a field number into the date
+ * \param field : A FieldCount value. Usually from AirField.
+ * \return MJD at that field
+ */
+uint16_t FieldToMJD(uint32_t field)
+{
+	uint16_t mjd;
+	uint32_t now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		mjd=MJD;
+		now=UTC;
+	}
+	// The field is never far ahead, so if its time is a lot less than now it is tomorrow
+	if (FieldToUTC(field)+3600<now)
+		mjd++;
+	return mjd;
+} // FieldToMJD
+
+uint8_t SetFIFODepthLimits(uint8_t min, uint8_t max)
+{
+	if (min<FIFOMINDEPTH || max>MAXFIFOINDEX || min>max)
+		return 1;
+	fifoDepthMin=min;
+	fifoDepthMax=max;
+	if (fifoDepth<min) fifoDepth=min;
+	if (fifoDepth>max) fifoDepth=max;
+	return 0;
+} // SetFIFODepthLimits
+
+/** Adaptive FIFO depth.
+ * If the FIFO ran dry, or FillFIFO didn't get called for a whole field,
+ * then we need more lookahead. Jump up by FIFODEPTHSTEP.
+ * If nothing went wrong for FIFOCALMSECONDS then trim it back by one block.
+ * Less lookahead means clocks, live pages and subtitles are less tardy.
+ */
+void FIFODepthControl(void)
+{
+	static uint32_t lastField;	// When we were last called
+	static uint32_t calmField;	// When we last had trouble (or last reduced the depth)
+	uint32_t field;
+	uint8_t underruns;
+	uint8_t depth;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		field=FieldCount;
+		underruns=fifoUnderruns;
+		fifoUnderruns=0;
+	}
+	depth=fifoDepth;
+	if (underruns || (field-lastField)>1)
+	{
+		fifoUnderrunTotal+=underruns;
+		depth+=FIFODEPTHSTEP;
+		if (depth>fifoDepthMax)
+			depth=fifoDepthMax;
+		calmField=field;
+	}
+	else
+	if ((field-calmField)>=(uint32_t)FIFOCALMSECONDS*50)
+	{
+		if (depth>fifoDepthMin)
+			depth--;
+		calmField=field;
+	}
+	fifoDepth=depth;
+	lastField=field;
+} // FIFODepthControl
+
 // TCC0, TCC1, TCD1 are all in use
 /** VBI Timer done. Signal to the main code (FillFIFO) that it is clear to load more vbi
  */
@@ -138,6 +265,10 @@ ISR(TCD0_OVF_vect)
 /*! Set up the FLD interrupt */
 uint8_t InitVBI(void)
 {
+	DeferOnSecond(ClockTick);	// First, so that the other handlers see the new time
+#ifdef RUN_FADER
+	DeferOnSecond(Fader);
+#endif
 
 	// LEDs_Init(); // TODO. Implement this!
 	/* Configure Interrupt0 to have medium interrupt level, triggered by pin 2. */
@@ -185,6 +316,7 @@ ISR(PORTC_INT0_vect)
  * The read pointer is incremented on each field EXCEPT:
  * 1) When the odd/even phase is wrong
  * 2) When there is no data ready
+ * 3) When the lane is being sent instead
  */
 ISR(TCE1_OVF_vect)
 {
@@ -197,34 +329,41 @@ ISR(TCE1_OVF_vect)
 		// kill the clock so as not to let it bother us
 		// CTRLA means Control register A, NOT Port A
 		timerFIFOBusyControl->CTRLA = ( timerFIFOBusyControl->CTRLA & ~TC1_CLKSEL_gm ) | TC_CLKSEL_OFF_gc;
-		// 1) Increment and wrap round to 0 if needed
-		nextBlock=(fifoReadIndex+1)%MAXFIFOINDEX;
-		// 2) Does the FIFO have a packet ready?
-		if (nextBlock==fifoWriteIndex)
-		{
-			// xputc('Y'); // no data available
-			return;
-		}
-		// 3) Is the odd/even phase correct?
-		if (nextBlock%2 != field) // Not correct? Wait for the next field. TODO: Check that the phase is correct! 
+		// At this point we are almost ready to transmit so this is where we consider subtitles
+		// 2a) Do we have subtitles buffered and ready?
+		if ((laneState==LANE_FIRST && field==laneField) || laneState==LANE_SECOND)
 		{
-			// xputc('y');		// phase wrong (were we delayed doing something?)
-			return;
+			// 2b) If so then set the fifo to read from that buffer
+			// Same odd/even sense as the ring: block n goes out when field!=n%2
+			SetSerialRamAddress(SPIRAM_READ, LANEBASE+(field^1)*FIFOBLOCKSIZE);
+			PORTC.OUT|=VBIT_SEL; // Set the mux to DENC.
+			// 2c) Making sure that we don't upset the main packet stream.
+			// The read index stays put. Both blocks go out so the ring keeps its odd/even phase.
+			laneState=(laneState==LANE_FIRST)?LANE_SECOND:LANE_IDLE;
 		}
 		else
 		{
+			// 1) Increment and wrap round to 0 if needed
+			nextBlock=(fifoReadIndex+1)%MAXFIFOINDEX;
+			// 2) Does the FIFO have a packet ready?
+			if (nextBlock==fifoWriteIndex)
+			{
+				fifoUnderruns=1;	// Tell FIFODepthControl that we need more lookahead
+				// xputc('Y'); // no data available
+				return;
+			}
+			// 3) Is the odd/even phase correct?
+			if (nextBlock%2 != field) // Not correct? Wait for the next field. TODO: Check that the phase is correct! 
+			{
+				// xputc('y');		// phase wrong (were we delayed doing something?)
+				return;
+			}
 			// Reset the FIFO ready to clock out TTX
 			fifoReadAddress=(fifoReadIndex*FIFOBLOCKSIZE); // move the buffer pointer to the next field's worth
 			SetSerialRamAddress(SPIRAM_READ, fifoReadAddress); // Set the FIFO to read from the current address
 			PORTC.OUT|=VBIT_SEL; // Set the mux to DENC.
+			fifoReadIndex=nextBlock;
 		}
-		// At this point we are almost ready to transmit so this is where we should consider subtitles
-		// 2a) Do we have subtitles buffered and ready?
-        // 2b) If so then set the fifo to read from that buffer
-        // 2c) Making sure that we don't upset the main packet stream 
-
-		
-		fifoReadIndex=nextBlock;	
 	}
 	else
 	{
@@ -40,13 +40,23 @@
 #ifndef _VBI_H_
 #define _VBI_H_
 #include "avr_compiler.h"
+#include <util/atomic.h>
 #include "xitoa.h"
 #include "vbit.h"
 #include "databroadcast.h"
+#include "defer.h"
 
 extern volatile uint8_t vbiDone; /// Goes high when the vbi has been transmitted
 extern volatile uint32_t UTC; /// Universal Coordinated Time
+extern volatile uint16_t MJD; /// Modified Julian Date. Goes up when UTC goes past midnight.
+extern volatile uint32_t FieldCount; /// Incremented on every field. Fields are 20ms.
 uint8_t InitVBI(void);
+/// The field number that the FIFO block currently being loaded will be transmitted on
+uint32_t AirField(void);
+/// The time of day (seconds) at a given field number
+uint32_t FieldToUTC(uint32_t field);
+/// The date (MJD) at a given field number
+uint16_t FieldToMJD(uint32_t field);
 extern volatile uint8_t FIFOBusy; /// High when the FIFO is due to be transmitted
 // A block is 45 bytes * 17 or 18 lines = 810 bytes (max)
 // The SPIRAM is 32kBytes. ie 0x40000/8=32768
@@ -54,10 +64,10 @@ extern volatile uint8_t FIFOBusy; /// High when the FIFO is due to be transmitte
 // But we also use a block number to denote the odd/even phase 
 // so we need an even number of blocks which gives us the same 40.
 // We will grab some of this memory for dynamic pages
-// [Idea: However, we want to allow for queue jumping to go on with subtitles
-// and any other "real time" page insertion. We will do this by
-// reserving one pair of blocks. A flag will signify if one or both
-// of these blocks has data (subtitles or live pages) that need to go out. ]
+// However, we want to allow for queue jumping to go on with subtitles
+// and any other "real time" page insertion. We do this by
+// reserving one pair of blocks (the lane). laneState signifies if
+// these blocks have data (subtitles or live pages) that need to go out.
 #define SPIRAMSIZE 32768
 #define FIFOBLOCKSIZE 810
 
@@ -69,13 +79,31 @@ extern volatile uint8_t FIFOBusy; /// High when the FIFO is due to be transmitte
 // #define MAXFIFOINDEX 40
 // So lets cut it down to 20 ahead.
 #define MAXFIFOINDEX 20
+// Better still, we don't have to choose. MAXFIFOINDEX is the size of the ring
+// but FillFIFO only gets fifoDepth blocks ahead. The depth shrinks towards
+// fifoDepthMin while FillFIFO keeps up, and grows towards fifoDepthMax when
+// the FIFO runs dry or FillFIFO misses fields (SD card stalls etc.)
+// The ring can't get any bigger than 20 because the dynamic pages live above it.
+#define FIFOMINDEPTH 2
+// How much the depth grows after an underrun
+#define FIFODEPTHSTEP 4
+// How many seconds without trouble before the depth is reduced by one
+#define FIFOCALMSECONDS 10
+
+// The priority lane. A pair of blocks (odd and even) straight after the FIFO ring.
+// Subtitles get loaded here and the FIFO switch sends them ahead of the ring.
+// The base address is 810*20 = 16200
+#define LANEBASE (FIFOBLOCKSIZE*MAXFIFOINDEX)
+#define LANE_IDLE	0	/// Nothing in the lane. It may be loaded.
+#define LANE_FIRST	1	/// Loaded. Waiting for field laneField
+#define LANE_SECOND	2	/// First block sent. The other block goes on the next field.
 
 // Now lets do some other calculations for what we are going to do with the spare space.
 // Assuming that we are storing whole pages in the form of raw packets.
 // These will be the dynamic pages, ones that play out direct from RAM.
 
-// The base address of these pages above the FIFO area is 810*20 = 16200.
-#define SRAMPAGEBASE (FIFOBLOCKSIZE*MAXFIFOINDEX)
+// The base address of these pages above the FIFO area and lane is 810*22 = 17820.
+#define SRAMPAGEBASE (LANEBASE+2*FIFOBLOCKSIZE)
 
 #define SRAMPAGEPACKETS 26
 // 24 lines + header + fastext = 26 x 45 = 1170 bytes per page.
@@ -85,15 +113,47 @@ extern volatile uint8_t FIFOBusy; /// High when the FIFO is due to be transmitte
 // It will also supply row 0 so we probably can save a row 0 here by not storing it]
 // This works out at 1170 bytes per dynamic page
 #define SRAMPAGESIZE (SRAMPAGEPACKETS*PACKETSIZE)
+// Each page is double buffered so that JW never writes on a row that is going out.
+// See dynpage.c
+#define SRAMPAGEBUFFERS 2
 // How many of these pages can we have?
-// I make it (32768-810*20)/1170=14
-// So this is RD,0 to RD,d
-#define SRAMPAGECOUNT ((SPIRAMSIZE-SRAMPAGEBASE)/SRAMPAGESIZE)
+// There is room for (32768-810*22)/(1170*2)=6 (it was 14 before the lane and double buffering)
+// but one goes to staging page uploads and the last one goes to the databroadcast queue.
+// So this is RD,0 to RD,3
+#define SRAMPAGECOUNT 4
+
+// ea lines and binary upload frames are held here until they are committed to pages.all.
+// 1170*2 = 2340 bytes, which is the biggest page (all subpages) that can be uploaded.
+// See stage.c
+#define STAGEBASE (SRAMPAGEBASE+SRAMPAGECOUNT*SRAMPAGESIZE*SRAMPAGEBUFFERS)
+#define STAGESIZE (SRAMPAGESIZE*SRAMPAGEBUFFERS)
+
+// The databroadcast queue takes the rest, 32768-810*22-1170*2*5 = 3248 bytes.
+// See databroadcast.c
+#define DBQUEUEBASE (STAGEBASE+STAGESIZE)
+#define DBQUEUESIZE (SPIRAMSIZE-DBQUEUEBASE)
 
-// So to access the page block n, the equation is
-// SRAMPAGEBASE+n*SRAMPAGESIZE
-// where n=0..SRAMPAGECOUNT-1
+// So to access copy b of page block n, the equation is
+// SRAMPAGEBASE+(n*SRAMPAGEBUFFERS+b)*SRAMPAGESIZE
+// where n=0..SRAMPAGECOUNT-1. Use DynPageRowAddress rather than working it out.
 
 extern volatile uint8_t fifoReadIndex; /// maintains the tx block index 0..MAXFIFOINDEX-1
 extern volatile uint8_t fifoWriteIndex; /// maintains the load index 0..MAXFIFOINDEX-1
+extern volatile uint8_t fifoDepth; /// How many blocks FillFIFO may get ahead of the read index
+extern uint8_t fifoDepthMin;	/// Lower limit for fifoDepth
+extern uint8_t fifoDepthMax;	/// Upper limit for fifoDepth
+extern uint16_t fifoUnderrunTotal;	/// Number of fields where there was nothing to send
+extern volatile uint8_t laneState;	/// LANE_IDLE, LANE_FIRST or LANE_SECOND
+extern uint8_t laneField;	/// The field (0 or 1) that the first lane block must go out on
+
+/** Set the limits for the FIFO depth controller
+ * \param min : FIFOMINDEPTH..MAXFIFOINDEX
+ * \param max : min..MAXFIFOINDEX
+ * \return 0 if OK, 1 if the limits are no good
+ */
+uint8_t SetFIFODepthLimits(uint8_t min, uint8_t max);
+
+/** Adjust the FIFO depth. FillFIFO calls this every time it runs.
+ */
+void FIFODepthControl(void);
 #endif
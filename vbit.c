@@ -25,9 +25,11 @@
 #include "vbit.h"
 
 #define sizearray(a)  (sizeof(a) / sizeof((a)[0]))
+#define DIRBATCH 50	// Most records from one DA or DN
+#define LINESIZE 120	// Longest command line, including the terminator
  
 /* Globals */
-unsigned char Line[120];			/* Console input buffer */
+unsigned char Line[LINESIZE];			/* Console input buffer */
 
 extern FATFS Fatfs[1];			/* File system object for the only logical drive */
 
@@ -48,6 +50,7 @@ static char pageFilter[6];
 static uint16_t FirstEntry;// last entry in a directory listing (DF and D+ commands)
 static uint16_t LastEntry;// last entry in a directory listing (DF and D+ commands)
 static uint16_t currentPage; // The current page being iterated
+static uint16_t dirCursor;	// The next page for DN
 
 FIL PageF;	// A file object if we need one outside of inserting.	
 
@@ -169,6 +172,71 @@ uint16_t LocatePage(int8_t step)
 	return currentPage;
 } // LocatePage
 
+/** Get the directory details of a page (subpage and control).
+ * They come from the display list if the page has been scanned, uploaded or on air.
+ * Otherwise the header of the page is parsed from pages.all.
+ * \param node : Display list node of the page
+ * \param page : Returns the details
+ * \return 0 if OK, 1 if the page doesn't parse
+ */
+static uint8_t DirectoryPage(DISPLAYNODE *node, PAGE *page)
+{
+	PAGEINDEXRECORD ixRec;
+	char str[80];
+	uint8_t res=0;
+	if (node->meta.body)	// Already parsed
+	{
+		page->subpage=node->meta.subpage;
+		page->control=node->meta.control;
+		page->time=node->meta.time;
+		if (node->flags & NODEOFFAIR)
+			page->control&=~CTRL_ENABLETX_bm;	// Disabled by MX
+		return 0;
+	}
+	// Instead treat the page like a single page
+	PageStoreGetIndex(node->pageindex,&ixRec.seekptr,&ixRec.pagesize);	// Read the page index
+	// Now seek the actual page that we are referencing
+	f_open(&PageF,"pages.all",FA_READ);
+	f_lseek(&PageF,ixRec.seekptr);	// Seek the actual page
+	// Parse down to the first OL
+	while (PageF.fptr<(ixRec.seekptr+ixRec.pagesize))
+	{
+		TaskYield();	// Keep the FIFO going
+		if (!f_gets(str,sizeof(str),&PageF))
+			break;
+		if (str[0]=='O' && str[1]=='L')
+			break;
+		if (ParseLine(page, str))
+		{
+			xprintf(PSTR("[insert]file error handler needed:%s\n"),str);
+			res=1;
+			break;
+		}
+	}	
+	f_close(&PageF);
+	if (node->flags & NODEOFFAIR)
+		page->control&=~CTRL_ENABLETX_bm;
+	return res;
+} // DirectoryPage
+
+/** Make a directory record
+ * bb mpp qq cc tttt ssss n xxxxxxx
+ * \param str : Returns the record
+ * \param addr : Page array address of the page
+ * \param page : Details from DirectoryPage
+ */
+static void DirectoryRecord(char *str, uint16_t addr, PAGE *page)
+{
+	// Leading zeros rely on PRINTF_LIB_FLOAT in makefile!!!
+	sprintf_P(str,PSTR("%02X %03X %02d %02X %04X 0000 %1d 00000000"),
+	3, // seconds (hex)
+	0x100+(addr/2), // mpp
+	page->subpage, // ss
+	page->control, // S
+	page->time,  // Cycle time (secs)
+	(addr>>9)+1); // Mag
+} // DirectoryRecord
+
 void testIni(void)
 {
 	xputs(PSTR("TestIni\n"));	
@@ -240,22 +308,20 @@ void testIni(void)
 /* A line starts with <ctrl-n>0 and ends with \r 
 Default to echo mode off.
 This code pinched from SD_Card_Demo
+It doesn't wait. It takes whatever characters have arrived and returns.
+\return 1 when there is a whole line in buff
 */
-static void get_line (char *buff, int len)
+static uint8_t get_line (char *buff, int len)
 {
 	unsigned char c;
-	int idx = 0;
+	static int idx = 0;
 	
-	unsigned char started=0;
+	static unsigned char started=0;
 
 	for (;;)
 	{
-		while (!USB_Serial_GetNB(&c)) // Any characters?
-			if (vbiDone) // do the next field?
-			{			
-				FillFIFO();
-				vbiDone=0; // Reset the flag
-			}
+		if (!USB_Serial_GetNB(&c)) // Any characters?
+			return 0;	// Not yet. Come back later.
 		if (c == '\r') break;
 		// killing \b will kill flashing. Probably need to make something more foolproof and resetting, We can get into a trap with passBackspace
 		if ((c == '\b') && idx && !passBackspace) {
@@ -273,11 +339,14 @@ static void get_line (char *buff, int len)
 	}
 	buff[idx++]='\r';	// Preserve the end of line
 	buff[idx] = 0;		// and cap it off
+	idx=0;				// Ready for the next line
+	started=0;
 	if (echoMode & 0x01) 
 	{
 		USB_Serial_Send(c);
 		USB_Serial_Send('\n');
 	}
+	return 1;
 } // get_line
 
 /** Test that page sequencing is working
@@ -440,8 +509,7 @@ void dumpPage(void)
 	// NB. Shared file access won't be a problem, I hope.
 	// xprintf(PSTR("Now we need to look up pages.idx[%d]\n\r"),n.pageindex);
 
-	f_lseek(&listFIL,(n.pageindex)*sizeof(PAGEINDEXRECORD));	// Seek the page index
-	f_read(&listFIL,&ixRec,sizeof(PAGEINDEXRECORD),&charcount);	// and read it	
+	PageStoreGetIndex(n.pageindex,&ixRec.seekptr,&ixRec.pagesize);	// Read the page index
 	
 	res=f_open(&Page,"pages.all",FA_READ);					// Now look for the relevant page
 	f_lseek(&Page,ixRec.seekptr);	// Seek the actual page
@@ -450,6 +518,7 @@ void dumpPage(void)
 	{
 		if (!f_gets(data,sizeof(data),&Page)) break;
 		xprintf(PSTR("%s"),data);
+		TaskYield();	// Keep the FIFO going
 	}
 
 	f_close(&Page);
@@ -466,10 +535,12 @@ static int vbit_command(char *Line)
 {
 	static uint8_t firstLine=true;
 	static uint16_t SRAMAddress;	// The address pointer into the FIFO serial ram
+	static uint8_t SRAMPage=0xff;	// Dynamic page selected by JA, or 0xff after JZ
 	unsigned char rwmode;
 	unsigned char returncode=0;
 	int pagecount;
 	uint8_t directorySteps;
+	uint16_t dirLast;
 	int8_t sign; // 1=plus -1=minus
 	char ch;
 	unsigned char valid;
@@ -487,15 +558,11 @@ static int vbit_command(char *Line)
 	// (also shared with ee/ea command for uploading pages)
 	NODEPTR np;
 	DISPLAYNODE node;
-	PAGEINDEXRECORD ixRec;
-	uint16_t charcount;	
 	uint8_t res;
-	DWORD fileptr;		// Used to save the file pointer to the body of the ttx file	
-	PAGE page;
+	static PAGE page;	// Static because ea builds it up over many lines
 	// ee/ea specific variable
-	static DWORD StartOfPage;
-	DWORD EndOfPage;	// Records the start and end of the new page
-	PAGEINDEXRECORD pageindex;
+	static uint8_t stageError;	// The staged page is no good. ee throws it away.
+	static PAGEMETA pageMeta;	// The header, as it was at the first OL line
 	uint16_t ix;
 
 	char packet[45];
@@ -530,18 +597,56 @@ static int vbit_command(char *Line)
 			SDCreateLists(i,pagecount);
 		sei();
 		break;
-	case 'D': // Directory - D[<F|L>][<+|->][<n>]
+	case 'D': // Directory - D[<F|L>][<+|->][<n>] or DA, DN
 		// Where F=first, L=Last, +=next, -=prev, n=number of pages to step (default 1)
+		// DA lists every page in the P filter, up to DIRBATCH at a time. DN carries on from there.
 		//xprintf(PSTR("D Command needs to be written"));
 		// It would probably be a good idea to save the seek pointer
 		// do the reading required
 		// and then reset it. This would save memory.
 		// If the ee command is active, don't allow D to mess the page variable.
-		if (firstLine)
+		if (!firstLine)
 		{
 			returncode=1; // ee command is busy. 
 			break;
 		}
+		if (Line[2]=='A')	// DA - All the pages in the P filter, a batch at a time
+			dirCursor=pageFilterToArray(0);
+		if (Line[2]=='A' || Line[2]=='N')	// DN - Next batch
+		{
+			// The records come from the display list, so this doesn't touch the card (much)
+			if (!pageFilter[0])
+			{
+				returncode=1;
+				break;
+			}
+			pagecount=0;
+			dirLast=pageFilterToArray(1);	// The last one
+			for (;dirCursor<=dirLast && pagecount<DIRBATCH;dirCursor+=2)
+			{
+				ix=dirCursor;
+				np=GetNodePtr(&ix);
+				if (np==NULLPTR)
+					continue;
+				GetNode(&node,np);
+				ClearPage(&page);
+				if (DirectoryPage(&node,&page))
+				{
+					returncode=1;
+					continue;
+				}
+				DirectoryRecord(str,dirCursor,&page);
+				xprintf(PSTR("%s\n\r"),str);
+				pagecount++;
+				TaskYield();	// Keep the FIFO going
+			}
+			// The number of records, and + if there are more to come (send DN)
+			if (dirCursor<=dirLast)
+				sprintf_P(str,PSTR("%04d+"),pagecount);
+			else
+				sprintf_P(str,PSTR("%04d"),pagecount);
+			break;
+		}
 		directorySteps=0;
 		sign=1;
 		for (i=2;Line[i];i++)
@@ -585,42 +690,10 @@ static int vbit_command(char *Line)
 			np=GetNodePtr(&currentPage);
 			// TODO: Handle sub pages
 			GetNode(&node,np);
-			// Instead treat the page like a single page
-			f_lseek(&listFIL,(node.pageindex)*sizeof(PAGEINDEXRECORD));	// Seek the page index
-			f_read(&listFIL,&ixRec,sizeof(PAGEINDEXRECORD),&charcount);	// and read it	
-			// Now seek the actual page that we are referencing
-			res=f_open(&PageF,"pages.all",FA_READ);					// Now look for the relevant page
-			f_lseek(&PageF,ixRec.seekptr);	// Seek the actual page
-			// Now we have the page, we need to seek through it to get
-			// the data
-			while (PageF.fptr<(ixRec.seekptr+ixRec.pagesize))
-			{
-				fileptr=PageF.fptr;		// Save the file pointer in case we found "OL"
-				f_gets(str,sizeof(str),&PageF);
-				if (str[0]=='O' && str[1]=='L')
-				{
-					f_lseek (&PageF, fileptr);	// Step back to the OL line
-					break;
-				}
-				if (ParseLine(&page, str))
-				{
-					xprintf(PSTR("[insert]file error handler needed:%s\n"),str);
-					// At this point we are stuffed.
-					f_close(&PageF);
-					returncode=1;
-					break; // what else should we do if we get here?
-				}
-			}	
-			// bb mpp qq cc tttt ssss n xxxxxxx
-			// Leading zeros rely on PRINTF_LIB_FLOAT in makefile!!!
-			sprintf_P(str,PSTR("%02X %03X %02d %02X %04X 0000 %1d 00000000"),
-			3, // seconds (hex)
-			0x100+(currentPage/2), // mpp
-			page.subpage, // ss
-			page.control, // S
-			page.time,  // Cycle time (secs)
-			(currentPage>>8)+1); // Mag
-			f_close(&PageF);
+			ClearPage(&page);
+			if (DirectoryPage(&node,&page))
+				returncode=1;
+			DirectoryRecord(str,currentPage,&page);
 		}
 		// str[0]=0;	// might return the directory paramaters here
 		break;
@@ -630,8 +703,7 @@ static int vbit_command(char *Line)
 		case 'M': // EM - Return Miscellaneous flags
 			{
 				// These are BFLSU. The code below is not correct
-				n = ini_getl("service", "serialmode", 0, inifile);	
-				if (n)
+				if (g_Config.serialMode)
 					xputs(PSTR("20"));
 				else
 					xputs(PSTR("00"));
@@ -642,81 +714,108 @@ static int vbit_command(char *Line)
 				returncode=1;
 		case 'O': // EO - Output dataline actions set by QO
 			// 18 characters on a line, but odd ignores last action
-			n = ini_gets("service", "outputodd", "111Q2233P445566778", str, sizearray(str), inifile);	
-			n = ini_gets("service", "outputeven", "111Q2233P445566778", str, sizearray(str), inifile);	
-			xprintf(PSTR("%s"),str);
+			xprintf(PSTR("%s"),g_Config.outputEven);
 			break;
 		}		
 		break; // E commands
-	case 'e' : // ea or ee : Upload page(s).
+	case 'e' : // ea or ee : Upload page(s). eb : Binary upload
 		// These pages add the lines at the end of the page file, and patch the index.
 		// Warning. "page" is shared with the directory command
 		// directory calls are blocked until you do ee.
 		switch (Line[2])
 		{
+		case 'b' : // Binary upload. See upload.h
+			if (!firstLine)	// ea is using the staging area
+			{
+				returncode=1;
+				break;
+			}
+			returncode=UploadStart();
+			if (!returncode)
+				sprintf_P(str,PSTR("W%d,P%d,L%d"),UPLOADWINDOW,UPLOADPAGES,UPLOADMAXFRAME);
+			break; // b
 		case 'a' : // Add a page, line at a time.
 			passBackspace=true;
 			if (firstLine)
 			{
 				firstLine=false;
 				ClearPage(&page); // Clear out our Page object
-				res=f_open(&PageF,"pages.all",FA_READ| FA_WRITE);	// Ready to write
-				// TODO: check the value of res
-				//xprintf(PSTR("Size of pages.all=%ul\n\r"),PageF.fsize);
-				/* Move to end of pages.all to append data */
-				res=f_lseek(&PageF, PageF.fsize);				
-				//xprintf(PSTR("lseek res=%d\n\r"),res);
-				StartOfPage=PageF.fptr;  // We need the Start Of Page for the index
+				// The page is staged in the serial RAM. Nothing goes to pages.all until ee.
+				StageClear();
+				stageError=0;
+				pageMeta.body=0;
+				FastextBegin();
 			}
 			// uh fellows, Although we get \r => Ctrl-P, we need to map it to 0x8d which is the file format.
 			for (ptr=&Line[4];*ptr;ptr++)
 				if (*ptr==0x10)
 					*ptr=0x8d;
-			f_puts(&Line[4],&PageF);	// The rest of the line is the file contents
-			f_putc('\n',&PageF);	// Add the LF that the interpreter strips out			
-			xprintf(PSTR("Now writing:%s\n\r"),&Line[4]);
+			if (FastextLine(&Line[4]))
+				xprintf(PSTR("Holding:%s\n\r"),&Line[4]);	// FL goes after FX, at ee
+			else
+			{
+				if (!pageMeta.body && Line[4]=='O' && Line[5]=='L')
+					MakePageMeta(&pageMeta,&page,StageLength());	// Where insert will find the rows
+				// The rest of the line is the file contents, and add the LF that the interpreter strips out
+				if (StageWrite(&Line[4],strlen(&Line[4])) || StageWrite("\n",1))
+				{
+					xprintf(PSTR("Page too big\n\r"));
+					stageError=1;
+					returncode=1;
+					break;
+				}
+				xprintf(PSTR("Now writing:%s\n\r"),&Line[4]);
+			}
 			// Don't unencode the line, pages.all should follow MRG \r => ctrl-P substitutions
 			// Probably can ignore Viewdata escapes.
-			// Write the rest of the line to pages.all
 			// Parse the line so we have all the page details so we know where to put it in the array/node
 			if (ParseLine(&page, &Line[4]))
 			{
 				xprintf(PSTR("Your page sucks. Unable to parse this nonsense\n\r"));
+				stageError=1;	// ee won't add it
 				returncode=1;	// failed
-				// TODO: implement the break
-				// break;
 			}
 			break; // a
 		case 'e' : // We finished. End the update
 			passBackspace=false;
-			EndOfPage=PageF.fptr;
-			f_close(&PageF);		// We are done with pages.all
-			// We need to refresh the transmission file object so close and re-open it
-			f_close(&pagefileFIL);
-			res=f_open(&pagefileFIL,"pages.all",FA_READ);		// Only need to open this once!			
-			// Or are we all done? We need to write the page to Pmpp.TTI so that we can rebuild the index later
-			pageindex.seekptr=StartOfPage;
-			pageindex.pagesize=(uint16_t)(EndOfPage-StartOfPage); // Warning! 16 bit file size limits to about 50 subpages.
-		    xprintf(PSTR("seek %ld size %d \n\r"),pageindex.seekptr,pageindex.pagesize);
-			// 1: Append pages.idx with the file start/end (append pageindex)
-			f_close(&listFIL); // TODO: Perhaps we should check that this is actually opened first?
-			res=f_open(&listFIL,"pages.idx",FA_READ| FA_WRITE);	// Ready to write // TODO: check the value of res
-			ix=listFIL.fsize;		// This is the address in the file
-			res=f_lseek(&listFIL, ix);	// Locate the end of the file
-			// Now append the page index
-			f_write(&listFIL,&(pageindex.seekptr),4,&charcount);	// 4 byte seek pointer
-			f_write(&listFIL,&(pageindex.pagesize),2,&charcount);	// 2 byte file size 			
-			// Now restore the file to the previous opened readonly state
-			f_close(&listFIL);
-		    res=f_open(&listFIL,"pages.idx",FA_READ);			
+			if (firstLine)	// There was no ea
+			{
+				returncode=1;
+				break;
+			}
+			firstLine=true;		// and reset ready for the next file
+			{
+				char fastext[FASTEXTENDSIZE];
+				FastextEnd(fastext,page.mag);	// Pre-encoded X/27/0 and the FL line
+				if (StageWrite(fastext,strlen(fastext)))
+					stageError=1;
+			}
+			if (stageError)
+			{
+				xprintf(PSTR("Page not added\n\r"));
+				returncode=1;
+				break;
+			}
+			// 1: Append the page to pages.all and pages.idx in one go. The transmission side sees it straight away.
+			res=StageCommit(0,StageLength(),page.mag,page.page,&ix);
+			if (res==STAGEUNCHANGED)
+			{
+				xprintf(PSTR("Page unchanged mag=%d page=%02X ix=%d\n\r"),page.mag,page.page,ix);
+				break;	// Nothing written. It is already on air.
+			}
+			if (res)
+			{
+				returncode=1;
+				break;
+			}
 			// 2: Add the page to the page array. (Or we could rebuild just by doing a restart)
-			ix=ix/sizeof(pageindex);
 			xprintf(PSTR("New page mag=%d page=%02X --> added at ix=%d\n\r"),page.mag,page.page,ix);
 			LinkPage(page.mag, page.page, page.subcode, ix);
+			SetPageMeta(&pageMeta);	// So it doesn't need to be parsed again
+			UrgentPage(page.mag, page.page);	// Get it on air now, not after a whole cycle
 			// TODO:
 			// 3: Add the page to the node list.  (ditto)
 			// TODO:
-			firstLine=true;		// and reset ready for the next file
 			break; // e
 		default:
 			str[0]=0;
@@ -742,30 +841,29 @@ static int vbit_command(char *Line)
 		case 'D' : /* up to 20 characters label*/
 			if (rwmode==CMD_MODE_READ)
 			{			
-				n = ini_gets("p830f1", "label", "VBITFax             ", str, sizearray(str), inifile);			
-				xprintf(PSTR("%s"),str);
+				xprintf(PSTR("%s"),g_Config.label);
 			}
 			if (rwmode==CMD_MODE_WRITE)
 			{
-				n = ini_puts("p830f1", "label", &Line[4], inifile);	
+				strncpy(g_Config.label,&Line[4],sizeof(g_Config.label)-1);
+				ConfigChanged(CONFIG_LABEL);
 				SetStatusLabel(pkt830,&Line[4]);
 			}			
 			break;
 		case 'L' : /* Link */
 			xputs(PSTR("GUL command\n"));
 			/* Alrighty. The MAG is already in the MRAG. All we actually need is 
-			ppssss where pp=hex page number and ssss=hex subcode */
-			n = ini_gets("p830f1", "initialpage", "003F7F", str, MAXSTR, inifile);
+			ppssss where pp=hex page number and ssss=hex subcode. It is in g_Config.initialPage */
 			break;
 		case 'N' : /* Net IC  */
 			if (rwmode==CMD_MODE_READ)
 			{
-				n = ini_gets("p830f1", "nic", "fa6f", str, sizearray(str), inifile);			
-				xprintf(PSTR("%s"),str);
+				xprintf(PSTR("%s"),g_Config.nic);
 			}
 			if (rwmode==CMD_MODE_WRITE)
 			{
-				n = ini_puts("p830f1", "nic", &Line[4], inifile);	
+				strncpy(g_Config.nic,&Line[4],sizeof(g_Config.nic)-1);
+				ConfigChanged(CONFIG_NIC);
 				SetNIC1(pkt830,&Line[4]);
 			}
 			break;
@@ -788,8 +886,9 @@ static int vbit_command(char *Line)
 		else
 		{
 			strncpy(g_Header,&Line[9],32); // accept new header
+			InvalidateHeader();
 			//g_Header[32]=0;					// Make sure it is capped
-			n = ini_puts("service", "header", g_Header, inifile);	// Save this value back to the INI file.
+			ConfigChanged(CONFIG_HEADER);	// Save this value back to the INI file, later
 		}
 		break;
 	case 'I': // III or I2
@@ -806,7 +905,7 @@ static int vbit_command(char *Line)
 		break;
 	case 'J' : // J<h>,DATA - Send a packet to SRAM address
 		// Probably want a whole family of J commands.
-		// JA<h> - Set the address pointer to SRAM page <h> where <h> is 0..d
+		// JA<h> - Set the address pointer to SRAM page <h> where <h> is 0..SRAMPAGECOUNT-1 (0..3)
 		// JW<data> - Write a complete 45 byte packet to the current address and increment
 		// JR<data> - Read back the next block of data and increment the pointer.
 		// [JT<h> - Retransmit page <h> immediately. (can't work. You must Tx the parent page) ]
@@ -824,13 +923,11 @@ static int vbit_command(char *Line)
 				returncode=1;					
 			else
 			{
-				n=SRAMPAGEBASE+n*SRAMPAGESIZE;	// This is the actual address
-				//xprintf(PSTR("JA address=%04X\n"),n);
-				SRAMAddress=n;
+				SRAMPage=n;	// dynpage works out the actual address
 				//row=1;
 			}
 			// We should now fill the packet with some instructions on how to use it!
-			// Set the SRAM page address 0..e. There are 14 pages 
+			// Set the SRAM page address 0..3. There are SRAMPAGECOUNT (4) pages 
 			// Coarse address setting
 			// For the lulz, JZ gives random access down to byte level
 			break;
@@ -844,7 +941,9 @@ static int vbit_command(char *Line)
 			// where only 15 bits are used.
 			// For finer control than the JA command.
 			// For the lulz and ability to plonk stuff using random access.
+			// Note that this bypasses the double buffering of dynamic pages.
 			SRAMAddress=n;
+			SRAMPage=0xff;
 			break;
 		case 'W': // JW,<row>,data - Write a packet to the SRAM page buffer
 			//xprintf(PSTR("JW Write SRAM data\n"));
@@ -857,8 +956,7 @@ static int vbit_command(char *Line)
 				break;
 			}
 			while (isdigit(*ptr) || *ptr==',') ptr++;	// Seek the comma after row
-			// If the fifo is transmitting, we must wait here
-			for (i=0;FIFOBusy;i++);	// Can this break if the video source has stopped? We may want to timeout on this!
+			// We don't wait for the FIFO. The packet is queued and FillFIFO writes it.
 			// xprintf(PSTR("JW addr=%d\n"),row);
 			// Write a single packet
 			// Not sure how we are going to map control codes but probably the same as OL 
@@ -871,7 +969,6 @@ static int vbit_command(char *Line)
 			// For the first attempt, I'll just copy the rest of the command line
 			// I think it is null terminated? Hmm or \r
 			// JW,<rest of command line>
-			PORTC.OUT&=~VBIT_SEL; // Set the mux to MPU so that we are in control
 			for (i=0;i<45;i++)packet[i]=0;
 			WritePrefix(packet, 5, row); // This prefix gets replaced later
 			packet[3]=row;	// The row gets encoded just before writing to FIFO
@@ -881,27 +978,60 @@ static int vbit_command(char *Line)
 			{
 				packet[i]=*ptr++ & 0x7f;	
 			}
-			// ** find the address of the row **
-			n=SRAMAddress+(row-1)*PACKETSIZE;
-			SetSerialRamAddress(SPIRAM_WRITE, n);
+			// Queue it. If the queue is full the host has to try again.
+			if (SRAMPage!=0xff)
+				returncode=DynPageWrite(SRAMPage,row,packet);
+			else
+				returncode=DynPageWriteRaw(SRAMAddress+(row-1)*PACKETSIZE,packet);
 			//xprintf(PSTR("JW write address=%04X\n"),n);
-
-			//SRAMAddress+=PACKETSIZE;
-			WriteSerialRam(packet,45);
-			DeselectSerialRam();
 			break;
 		case 'R':
 			xprintf(PSTR("JR Read back SRAM data\n"));
 			// Read back a single packet (translated back into OL format)
 			break;
-		case 'T':
-			xprintf(PSTR("JT Transmit mpp\n"));
-			// Set a flag to transmit the selected page ASAP.
+		case 'T': // JT<mpp> - Transmit page <mpp> ASAP, with C8 set
+			Line[1]='0';Line[2]='x';
+			ptr=&Line[1];
+			xatoi(&ptr,&n);
+			if (n<0x100 || n>0x8ff || UrgentPage(n/0x100,n%0x100))
+				returncode=1;
 			break;
 		default:
 			returncode=1;
 		}
 		break;
+	case 'K': // K - Manifest. The key and content hash of every page selected by the last P command
+		// One line per page, "mpp ss hhhhhhhh", then the page count like P.
+		// A scheduler can compare this with what it has and only upload the differences.
+		if (!pageFilter[0])
+		{
+			returncode=1;
+			break;
+		}
+		pagecount=0;
+		{
+			uint16_t addr;
+			uint16_t last=pageFilterToArray(1);
+			uint32_t hash;
+			for (addr=pageFilterToArray(0);addr<=last;addr+=2)
+			{
+				ix=addr;
+				np=GetNodePtr(&ix);
+				if (np==NULLPTR)
+					continue;
+				GetNode(&node,np);
+				if (PageStoreGetHash(node.pageindex,&hash))
+				{
+					returncode=1;
+					continue;
+				}
+				xprintf(PSTR("%1d%02X %02d %08lX\n\r"),(addr>>9)+1,(addr>>1)&0xff,node.subpage,hash);
+				pagecount++;
+				TaskYield();	// Keep the FIFO going
+			}
+		}
+		sprintf_P(str,PSTR("%04d"),pagecount);
+		break;
 	case 'L': // L<nn>,<line data>
 		// We don't use L in vbit. Because it would require RAM buffering or more file writing,
 		// instead we use the e command which writes the file directly.
@@ -909,11 +1039,33 @@ static int vbit_command(char *Line)
 		str[0]=0;
 		returncode=1;
 		break;
-	case 'M': // MD - Delete all the pages selected by the last P command.
-		xprintf(PSTR("Delete...\n"));
-		// Iterate down all the pages
-		// Traverse down subpages and release nodes
-		// Go into the pages index and null out the entries in pages.idx
+	case 'M': // M - Range operations on all the pages selected by the last P command.
+		// MD - Delete. ME - Enable. MX - Disable (take off air but keep).
+		// They only touch the display list, so they work at once. MD takes the pages
+		// out of pages.idx in the background. Returns the page count like P.
+		if (!pageFilter[0])
+		{
+			returncode=1;
+			break;
+		}
+		switch (Line[2])
+		{
+		case 'D':
+			n=RANGEDELETE;
+			break;
+		case 'E':
+			n=RANGEENABLE;
+			break;
+		case 'X':
+			n=RANGEDISABLE;
+			break;
+		default:
+			returncode=1;
+		}
+		if (returncode)
+			break;
+		pagecount=PageRange(pageFilterToArray(0),pageFilterToArray(1),(uint8_t)n);
+		sprintf_P(str,PSTR("%04d"),pagecount);
 		break;
 	case 'O':	/* O - Opt out. Example: O1c*/
 		/* Two digit hex number. Only 6 bits are used so the valid range is 0..3f */
@@ -970,13 +1122,14 @@ static int vbit_command(char *Line)
 		sprintf_P(str,PSTR("%04d"),pagecount); // Where nnn is the number of pages in this filter. 099 is a filler ack and checksum 
 		// str[0]=0;
 		break;
-	case 'Q' : // QO, QM
+	case 'Q' : // QO, QM, QF, QR, QB, QS
 		if (Line[2]=='M') // QMnn
 		{
 			ptr=&Line[3];
 			xatoi(&ptr,&n);
 			xprintf(PSTR("QM command, n=%d\n"),n);
-			n = ini_putl("service", "serialmode", n, inifile);	
+			g_Config.serialMode=n;
+			ConfigChanged(CONFIG_SERIALMODE);
 			// And at this point put it into the vbi configuration
 			// vbi_mode_serial=0 or CTRL_C11_MAGAZINESERIAL_bm
 			/** TBA. This setting needs to be in the VBI section
@@ -987,6 +1140,70 @@ static int vbit_command(char *Line)
 			*/
 			break;
 		}
+		if (Line[2]=='F') // QF<min>,<max> FIFO lookahead limits in fields
+		{
+			long m;
+			ptr=&Line[3];
+			if (!xatoi(&ptr,&n) || *ptr++!=',' || !xatoi(&ptr,&m) || SetFIFODepthLimits(n,m))
+			{
+				returncode=1;
+				break;
+			}
+			g_Config.fifoMin=n;
+			g_Config.fifoMax=m;
+			ConfigChanged(CONFIG_FIFOMIN|CONFIG_FIFOMAX);
+			break;
+		}
+		if (Line[2]=='R') // QR<n> Row-delta repeats. Full page every n cycles. 0 is off.
+		{
+			ptr=&Line[3];
+			if (!xatoi(&ptr,&n) || n<0 || n>99)
+			{
+				returncode=1;
+				break;
+			}
+			SetDeltaCycle(n);
+			g_Config.deltaCycle=n;
+			ConfigChanged(CONFIG_DELTACYCLE);
+			break;
+		}
+		if (Line[2]=='B') // QB<n> Fastext prefetch. n normal pages between boosted ones. 0 is off.
+		{
+			ptr=&Line[3];
+			if (!xatoi(&ptr,&n) || n<0 || n>99)
+			{
+				returncode=1;
+				break;
+			}
+			SetFastextBoost(n);
+			g_Config.fastextBoost=n;
+			ConfigChanged(CONFIG_FASTEXTBOOST);
+			break;
+		}
+		if (Line[2]=='S') // QS<s>,<period>,<count> Periodic packets. s=0 8/30 format 1, 1 databroadcast
+		{
+			long m,c;
+			ptr=&Line[3];
+			if (!xatoi(&ptr,&n) || *ptr++!=',' || !xatoi(&ptr,&m) || *ptr++!=',' || !xatoi(&ptr,&c) ||
+				m<0 || m>255 || c<0 || SetSchedule(n,m,c))
+			{
+				returncode=1;
+				break;
+			}
+			if (n)
+			{
+				g_Config.dbPeriod=m;
+				g_Config.dbCount=c;
+				ConfigChanged(CONFIG_DBPERIOD|CONFIG_DBCOUNT);
+			}
+			else
+			{
+				g_Config.p830Period=m;
+				g_Config.p830Count=c;
+				ConfigChanged(CONFIG_P830PERIOD|CONFIG_P830COUNT);
+			}
+			break;
+		}
 		// QO sets both odd and even lines
 		// QD only sets the odd.
 		if (Line[2]=='O' || Line[2]=='D') // QO[18 characters <P|Q|1..8|F>]. QD is the odd line and has 18 lines
@@ -1017,21 +1234,42 @@ static int vbit_command(char *Line)
 			}
 			*ptr=0;
 			if (returncode) break;
-			n = ini_puts("service", "outputodd", &Line[3], inifile);	
+			strcpy(g_Config.outputOdd,&Line[3]);
+			n=CONFIG_OUTPUTODD;
 			if (Line[2]=='O')
-				n = ini_puts("service", "outputeven", &Line[3], inifile);	// QO only
+			{
+				strcpy(g_Config.outputEven,&Line[3]);	// QO only
+				n|=CONFIG_OUTPUTEVEN;
+			}
+			ConfigChanged(n);
 			break;
 		}
 		returncode=1;
 		break;
 	// We could probably use the S command to encapsulate Newfor. We aren't going to be setting the page status much.
-	case 'S' : ; // Newfor. This should be a Newfor command. Hmm, but how to escape SO and SI?
-		// Work out how to escape data. The parity and reserved characters will break the CI
+	case 'S' : ; // Newfor. SP, SB, SL, SR, SC. See subtitle.c
+		// Control codes are escaped the same as OL lines, by setting bit 7
+		returncode=SubtitleCommand(Line);
 		break;
 	case 'T': // T <hhmmss> (this syntax was superceded by GUT and GUt)
 		// testIni();
 		// test3();
 		// test2();
+		if (Line[2]=='D') // TD<mjd> Set the date for packet 8/30
+		{
+			ptr=&Line[3];
+			if (!xatoi(&ptr,&n) || n<0 || n>65535)	// MJD is 16 bits
+			{
+				returncode=1;
+				break;
+			}
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				MJD=n;
+			}
+			str[0]=0;
+			break;
+		}
 		// UTC is the time of day in seconds
 		Line[8]=0;
 		ptr=&(Line[2]);
@@ -1081,35 +1319,127 @@ static int vbit_command(char *Line)
 		else
 			returncode=1;	// No, it failed
 		break;
-	case 'W': // TEST Ad-tec opt outs
-		// W14 - Send a mode 14 opt out
-		// We want to be able to test various ATP950 modes.
-		// read the parameter
-		ptr=&Line[2];	
-		xatoi(&ptr,&n);
-		OptOutMode=n;
-		xprintf(PSTR("W=%04X\n"),OptOutMode);
-		// Which command? Set the appropriate opt out mode
-		switch (OptOutMode)
+	case 'W': // Opt-outs. See optout.h
+		// WT<t>,<fields> - Trigger type t (0=preroll, 1=start, 2=stop) on the field that many fields from now
+		// WA<hex6> - Address, WD<t>,<hex> - User data of a frame, WR<repeats>,<cadence>
+		// W14 - Send a start now (the old Ad-tec test)
+		switch (Line[2])
 		{
-		case 14:
-			xprintf(PSTR("Mode 14 shenanigans\n"),n);
-			// Or just flag that we want an opt-out packet
-			OptOutMode=14;
-			OptOutType=OPTOUT_START;
-			// Assemble a mode 14 packet
+		case 'T':
+			{
+				long m;
+				ptr=&Line[3];
+				m=0;
+				if (!xatoi(&ptr,&n) || n<0 || (*ptr++==',' && (!xatoi(&ptr,&m) || m<0 || m>0xffff)))
+				{
+					returncode=1;
+					break;
+				}
+				returncode=OptOutTrigger(n,m);
+			}
+			break;
+		case 'A':
+			if (OptOutSetAddress(&Line[3]))
+			{
+				returncode=1;
+				break;
+			}
+			memcpy(g_Config.optOutAddress,&Line[3],OPTOUTADDRESSLENGTH);
+			g_Config.optOutAddress[OPTOUTADDRESSLENGTH]=0;
+			ConfigChanged(CONFIG_OPTOUTADDRESS);
+			break;
+		case 'D':
+			ptr=&Line[3];
+			if (!xatoi(&ptr,&n) || *ptr++!=',' || n<0 || OptOutSetFrame(n,ptr))
+			{
+				returncode=1;
+				break;
+			}
+			for (i=0;i<OPTOUTDATALENGTH*2 && ptr[i] && ptr[i]!='\n' && ptr[i]!='\r';i++);
+			memcpy(g_Config.optOutFrame[n],ptr,i);
+			g_Config.optOutFrame[n][i]=0;
+			ConfigChanged(CONFIG_OPTOUTFRAME<<n);
+			break;
+		case 'R':
+			{
+				long m;
+				ptr=&Line[3];
+				if (!xatoi(&ptr,&n) || *ptr++!=',' || !xatoi(&ptr,&m) ||
+					n<0 || n>255 || m<0 || m>255 || OptOutSetRepeat(n,m))
+				{
+					returncode=1;
+					break;
+				}
+				g_Config.optOutRepeats=n;
+				g_Config.optOutCadence=m;
+				ConfigChanged(CONFIG_OPTOUTREPEATS|CONFIG_OPTOUTCADENCE);
+			}
 			break;
 		default:
-			OptOutMode=0;
-			returncode=1;
+			ptr=&Line[2];
+			if (xatoi(&ptr,&n) && n==14)
+				returncode=OptOutTrigger(OPTOUT_START,0);
+			else
+				returncode=1;
 		}
-		// Assemble the packet and 
 		break;
 	case 'X':	/* X - Exit */
 		return 2;	
 	case 'Y': /* Y - Version. Y2 should return a date string */
 		strcpy_P(str,PSTR("VBIT620 Version 0.04"));
 		break;		
+	case 'Z': // Databroadcast. See databroadcast.h
+		// ZP<c>,<hex> - Queue data on channel c. ZF<c> - Report the room left in channel c.
+		// ZC<c>,<address>,<weight>,<repeats> - Set up channel c. ZC<c>, turns it off.
+		// Flow control: a ZP that doesn't fit is refused and nothing is queued.
+		// ZP and ZF return the room left, so the host knows when to try again.
+		ptr=&Line[3];
+		if (!xatoi(&ptr,&n) || n<0 || n>=DBCHANNELS)
+		{
+			returncode=1;
+			break;
+		}
+		if (Line[2]=='P' && *ptr++==',')
+		{
+			uint8_t data[(LINESIZE-5)/2];	// Line is the parameter here, so not sizeof(Line)
+			unsigned int byte;
+			uint8_t len=0;
+			uint8_t res;
+			for (;len<sizeof(data) && isxdigit(ptr[0]) && isxdigit(ptr[1]);ptr+=2)
+			{
+				sscanf(ptr,"%2X",&byte);
+				data[len++]=byte;
+			}
+			if (!len || *ptr!='\r')
+				returncode=1;
+			else
+			{
+				// If the DENC has the serial RAM, wait for it to finish
+				while ((res=DataBroadcastPut(n,data,len))==DBBUSY && !TaskWaitFIFO());
+				if (res)
+					returncode=1;
+			}
+		}
+		else if (Line[2]=='C' && *ptr++==',')
+		{
+			for (i=0;ptr[i] && ptr[i]!='\r';i++);
+			ptr[i]=0;
+			if (i>=DBCHANNELSETTING || DataBroadcastConfigure(n,ptr))
+			{
+				returncode=1;
+				break;
+			}
+			strcpy(g_Config.dbChannel[n],ptr);
+			ConfigChanged(CONFIG_DBCHANNEL<<n);
+			break;
+		}
+		else if (Line[2]!='F')
+		{
+			returncode=1;
+			break;
+		}
+		sprintf_P(str,PSTR("%u"),DataBroadcastFree(n));
+		break;
 	case '?' :; // Status TODO
 		xprintf(PSTR("STATUS %02X\n\r"),statusI2C);
 		// Want to know if the chips check out and the file system is OK
@@ -1119,9 +1449,13 @@ static int vbit_command(char *Line)
 		xprintf(PSTR("Digital encoder: "));report(statusI2C & 0x02); // chip responds
 		// FIFO
 		statusFIFO=test2();
+		TaskYield();	// The test had the serial RAM
 		xprintf(PSTR("FIFO R/W verified: "));report(statusFIFO); // we can read and write to it
 		// File system
 		xprintf(PSTR("File system: "));report(statusDisk); // There is a card, it is formatted, it has onair/pages.all
+		// FIFO lookahead
+		xprintf(PSTR("FIFO depth: %d (%d..%d) underruns: %u\n\r"),fifoDepth,fifoDepthMin,fifoDepthMax,fifoUnderrunTotal);
+		xprintf(PSTR("Deferred field overruns: %u\n\r"),deferOverruns);
 		break;
 	default:
 		xputs(PSTR("Unknown command\n"));
@@ -1132,14 +1466,27 @@ static int vbit_command(char *Line)
 }
 
 /* Load settings from SD card
- * inserter.ini
+ * test.ini. This is the only time that most of it is read. See config.h
 */
 int LoadINISettings(void)
 {
 	int n;
-	n = ini_gets("service", "outputodd",  "111Q2233P44556678Q", &(g_OutputActions[0][0]), 18, inifile);	
-	n = ini_gets("service", "outputeven", "111Q2233P44556678Q", &(g_OutputActions[1][0]), 18, inifile);	
-	n = ini_gets("service", "header",     "mpp MRG DAY dd MTH", g_Header, 33, inifile);
+	ConfigLoad();
+	memcpy(g_OutputActions[0],g_Config.outputOdd,sizeof(g_OutputActions[0]));
+	memcpy(g_OutputActions[1],g_Config.outputEven,sizeof(g_OutputActions[1]));
+	InvalidateHeader();
+	SetFIFODepthLimits(g_Config.fifoMin,g_Config.fifoMax);
+	SetDeltaCycle(g_Config.deltaCycle);
+	SetFastextBoost(g_Config.fastextBoost);
+	Init830F1();
+	SetSchedule(SCHED_830F1,g_Config.p830Period,g_Config.p830Count);
+	SetSchedule(SCHED_DATABROADCAST,g_Config.dbPeriod,g_Config.dbCount);
+	OptOutSetAddress(g_Config.optOutAddress);
+	for (n=0;n<OPTOUTTYPES;n++)
+		OptOutSetFrame(n,g_Config.optOutFrame[n]);
+	OptOutSetRepeat(g_Config.optOutRepeats,g_Config.optOutCadence);
+	for (n=0;n<DBCHANNELS;n++)
+		DataBroadcastConfigure(n,g_Config.dbChannel[n]);
 	return 0; // TODO: Return success or otherwise
 }
 
@@ -1168,11 +1515,19 @@ int RunVBIT(void)
 	statusVBI=InitVBI();			// Set up the video timing
 	LoadINISettings();
 	InitDataBroadcast();
-	for (;;)
+	TaskInit();
+	for (;;)	// See task.h for the order of things
 	{
 		// xputc('>'); // no room for a prompt
-		get_line((char*)Line, sizeof(Line));
-		if (vbit_command((char*)Line)==2) break;
+		TaskYield();
+		if (UploadActive())
+			UploadService();	// Binary upload. Characters are frames, not commands
+		else if (get_line((char*)Line, sizeof(Line)))
+		{
+			if (vbit_command((char*)Line)==2) break;
+		}
+		else
+			TaskRunJobs();
 	}
 	xputs(PSTR("VBIT Terminated. Have a Nice Day\n"));
 	return 0;
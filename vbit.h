@@ -54,6 +54,16 @@
 #include "databroadcast.h"
 #include "displaylist.h"
 #include "magstream.h"
+#include "pagestore.h"
+#include "subtitle.h"
+#include "dynpage.h"
+#include "fastext.h"
+#include "schedule.h"
+#include "optout.h"
+#include "task.h"
+#include "upload.h"
+#include "stage.h"
+#include "config.h"
 		
 #include "../../Common/Terminal/TerminalDriver.h"
 #include "../../Common/Terminal/TerminalEvents.h"	